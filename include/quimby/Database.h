@@ -9,6 +9,7 @@
 #include <algorithm>
 #include <limits>
 #include <set>
+#include <vector>
 
 namespace quimby {
 
@@ -21,7 +22,31 @@ public:
 	}
 	virtual void begin(const Database& db) = 0;
 	virtual bool intersects(const Vector3f& lower, const Vector3f& upper, float margin) = 0;
+	// Box of all positions the visitor is interested in, without the particle
+	// margin. Databases only test the blocks overlapping it. False if unbounded.
+	virtual bool getBounds(Vector3f& /*lower*/, Vector3f& /*upper*/) {
+		return false;
+	}
+	// Copy for one thread of Database::acceptParallel, as after begin and
+	// without results. 0 if the visitor can not be copied.
+	virtual DatabaseVisitor* clone() const {
+		return 0;
+	}
+	// Adds the results of a clone, after its end.
+	virtual void reduce(DatabaseVisitor& /*clone*/) {
+	}
 	virtual void visit(const SmoothParticle& p) = 0;
+	// The n particles of a block of the database, contiguous in the mapping.
+	// payload holds their kernel payload, 0 if the database has none. Calls
+	// visit for the particles intersecting the visitor by default.
+	virtual void visitBlock(const SmoothParticle* particles,
+	                        const KernelPayload* /*payload*/, size_t n) {
+		for (size_t i = 0; i < n; i++) {
+			const SmoothParticle& p = particles[i];
+			if (intersects(p.position, p.position, p.smoothingLength))
+				visit(p);
+		}
+	}
 	virtual void end() = 0;
 };
 
@@ -30,8 +55,10 @@ public:
 
 	virtual ~Database() {
 	}
+	// In parallel the particles are appended in no particular order.
 	size_t getParticles(const Vector3f& lower, const Vector3f& upper,
-	                    std::vector<SmoothParticle>& particles) const;
+	                    std::vector<SmoothParticle>& particles,
+	                    bool parallel = false) const;
 
 	virtual Vector3f getLowerBounds() const = 0;
 	virtual Vector3f getUpperBounds() const = 0;
@@ -40,6 +67,12 @@ public:
 	virtual size_t getCount() const = 0;
 
 	virtual void accept(DatabaseVisitor& visitor) const = 0;
+
+	// Traversal by all threads, each with a clone of the visitor. Serial for
+	// visitors without clone.
+	virtual void acceptParallel(DatabaseVisitor& visitor) const {
+		accept(visitor);
+	}
 };
 
 class FileDatabase: public Database {
@@ -49,15 +82,81 @@ class FileDatabase: public Database {
 		unsigned int start, count;
 	};
 
+	// Version 2 files store the particles as structure of arrays, see
+	// createSoA.
+	struct SoAHeader {
+		char magic[8];
+		uint32_t version;
+		uint32_t count;
+		Vector3f lower, upper;
+		uint64_t blocks_per_axis;
+		uint64_t capacity;
+	};
+
+	// version 3 adds the kernel payload arrays
+	enum SoAArray {
+		soaX, soaY, soaZ, soaH, soaBX, soaBY, soaBZ, soaMass, soaRho,
+		soaParticleArrays,
+		soaKX = soaParticleArrays, soaKY, soaKZ, soaKDensity, soaKInvH,
+		soaArrays
+	};
+
+	enum {
+		soaChunk = 256
+	};
+
 	unsigned int count;
 	Vector3f lower, upper;
 	size_t blocks_per_axis;
 	std::vector<Block> blocks;
+	float margin;
 	std::string filename;
 
 	const SmoothParticle *particles;
+	const float *arrays[soaArrays];
+	bool soa, payload;
 	MMapFile file;
 
+	size_t toBlockIndex(float x, float lower, float blockSize) const;
+	bool blockRange(bool bounded, const Vector3f& query_lower,
+	                const Vector3f& query_upper, size_t* first,
+	                size_t* last) const;
+
+	size_t gather(const Block& block, size_t first, bool bounded,
+	              const Vector3f& query_lower, const Vector3f& query_upper,
+	              SmoothParticle* out, KernelPayload* out_payload) const;
+
+	template<class Visitor>
+	void acceptBlock(Visitor& visitor, size_t iX, size_t iY, size_t iZ,
+	                 bool bounded, const Vector3f& query_lower,
+	                 const Vector3f& query_upper) const {
+		const Vector3f blockSize = (upper - lower) / blocks_per_axis;
+		const Vector3f box_lower = lower
+				+ Vector3f(iX * blockSize.x, iY * blockSize.y, iZ * blockSize.z);
+		const Block& block = blocks[(iX * blocks_per_axis + iY) * blocks_per_axis
+				+ iZ];
+
+		if (!visitor.intersects(box_lower, box_lower + blockSize, block.margin))
+			return;
+
+		if (!soa) {
+			visitor.visitBlock(particles + block.start, 0, block.count);
+			return;
+		}
+
+		// particles outside the bounds are dropped before the payload is read
+		SmoothParticle buffer[soaChunk];
+		KernelPayload kernel_buffer[soaChunk];
+		KernelPayload* kernel = payload ? kernel_buffer : 0;
+
+		for (size_t first = 0; first < block.count; first += soaChunk) {
+			size_t n = gather(block, first, bounded, query_lower, query_upper,
+			                  buffer, kernel);
+			if (n)
+				visitor.visitBlock(buffer, kernel, n);
+		}
+	}
+
 public:
 
 	FileDatabase();
@@ -71,11 +170,50 @@ public:
 
 	size_t getCount() const;
 
+	// Versions 2 and 3 are converted from a temporary version 1 file, see
+	// createSoA.
 	static void create(std::vector<SmoothParticle>& particles,
 	                   const std::string& filename, size_t blocks_per_axis = 100,
-	                   bool verbose = false);
+	                   bool verbose = false, unsigned int version = 1);
+
+	// Converts a database to version 2, with the blocks of each particle
+	// attribute in a separate array and each block aligned to 32 bytes.
+	// Queries with bounds cull the positions and smoothing lengths before
+	// the other attributes are read. With payload, version 3 additionally
+	// stores the KernelPayload of each particle, handed to the visitors so
+	// they need not compute it per visit. open reads all versions.
+	static void createSoA(const std::string& input, const std::string& output,
+	                      bool payload = false);
+
+	bool isSoA() const;
+	bool hasPayload() const;
 
 	void accept(DatabaseVisitor& visitor) const;
+	void acceptParallel(DatabaseVisitor& visitor) const;
+
+	// Accept for visitors of a known type, which need begin, getBounds,
+	// intersects, visitBlock and end but no base class. Visitors without
+	// virtual methods, or of a final class, are called without dispatch.
+	template<class Visitor>
+	void accept(Visitor& visitor) const {
+		if (count == 0)
+			return;
+
+		Vector3f query_lower, query_upper;
+		size_t first[3], last[3];
+		bool bounded = visitor.getBounds(query_lower, query_upper);
+		bool any = blockRange(bounded, query_lower, query_upper, first, last);
+
+		visitor.begin(*this);
+
+		for (size_t iX = first[0]; any && iX <= last[0]; iX++)
+			for (size_t iY = first[1]; iY <= last[1]; iY++)
+				for (size_t iZ = first[2]; iZ <= last[2]; iZ++)
+					acceptBlock(visitor, iX, iY, iZ, bounded, query_lower,
+					            query_upper);
+
+		visitor.end();
+	}
 };
 
 class Databases: public Database {
@@ -99,18 +237,31 @@ public:
 	float getMargin() const;
 
 	void accept(DatabaseVisitor& visitor) const;
+	void acceptParallel(DatabaseVisitor& visitor) const;
 };
 
+// Writes the quantity a particle deposits per kernel value to value, one
+// float per channel. payload is 0 if the database has none.
+typedef void (*SamplingAttribute)(const SmoothParticle& particle,
+                                  const KernelPayload* payload, float* value);
+
+// Deposits the magnetic field, or any attribute of channels floats, on an N^3
+// grid of interleaved channels.
 class SimpleSamplingVisitor: public DatabaseVisitor {
-	Vector3f* data;
+	float* data;
+	size_t channels;
+	SamplingAttribute attribute;
 	size_t N, count;
 	Vector3f offset;
 	float size, cell;
 	bool progress;
+	bool firstSlab;	// false for the slabs of sample after the first
 	size_t xmin, xmax, ymin, ymax, zmin, zmax;
 	AABB<float> box;
+	std::vector<float> buffer;	// private grid of a clone
 	size_t toLowerIndex(double x);
 	size_t toUpperIndex(double x);
+	void deposit(const SmoothParticle& particle, const KernelPayload* payload);
 
 public:
 
@@ -118,13 +269,29 @@ public:
 	                      float size);
 	SimpleSamplingVisitor(Grid<Vector3f>& grid, const Vector3f& offset,
 	                      float size);
+	SimpleSamplingVisitor(float* data, size_t channels,
+	                      SamplingAttribute attribute, size_t N,
+	                      const Vector3f& offset, float size);
 	void begin(const Database& db);
 	bool intersects(const Vector3f& lower, const Vector3f& upper, float margin);
+	bool getBounds(Vector3f& lower, Vector3f& upper);
+	// Clones sample into a private grid of N^3 cells, added to the grid in
+	// reduce. That is 1.6 GB per thread for the field on 512^3 cells, sample
+	// needs no copies of the grid.
+	DatabaseVisitor* clone() const;
+	void reduce(DatabaseVisitor& clone);
 	void visit(const SmoothParticle& part);
+	void visitBlock(const SmoothParticle* particles,
+	                const KernelPayload* payload, size_t n);
 	void end();
 
 	void limit(size_t xmin, size_t xmax, size_t ymin, size_t ymax, size_t zmin,
 	           size_t zmax);
+	// Parallel accept of db, the x range is split into slabs sampled by
+	// separate threads. Same grid and count as db.accept(*this), particles
+	// on slab borders are counted in the lowest slab they reach. A single
+	// accept inside a parallel region or with one thread.
+	void sample(const Database& db);
 	void showProgress(bool progress);
 	size_t getCount();
 };
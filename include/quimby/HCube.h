@@ -4,9 +4,22 @@
 #include "Database.h"
 #include "MagneticField.h"
 #include "MMapFile.h"
+#include "MurmurHash2.h"
+#include "HCubeElement.h"
+#include "PagedGrid.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
 #include <cstring>
+#include <ctime>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
 
 namespace quimby {
 
@@ -17,8 +30,99 @@ public:
 	}
 };
 
+typedef enum HCubeStatus_ {
+	HCubeValid,
+	HCubeInvalidPosition
+} HCubeStatus;
+
+// Derivatives of a vector field at a point, the columns of the Jacobian.
+struct HCubeJacobian {
+	Vector3f value;
+	Vector3f dx, dy, dz;
+
+	float divergence() const {
+		return dx.x + dy.y + dz.z;
+	}
+
+	Vector3f curl() const {
+		return Vector3f(dy.z - dz.y, dz.x - dx.z, dx.y - dy.x);
+	}
+
+	// gradient of the field strength
+	Vector3f magnitudeGradient() const {
+		const float b = value.length();
+
+		if (b == 0)
+			return Vector3f(0, 0, 0);
+
+		return Vector3f(value.x * dx.x + value.y * dx.y + value.z * dx.z,
+		                value.x * dy.x + value.y * dy.y + value.z * dy.z,
+		                value.x * dz.x + value.y * dz.y + value.z * dz.z) / b;
+	}
+};
+
+// Order of the cubes in a file. Child offsets are always relative and
+// forward, readers do not depend on the layout.
+typedef enum HCubeLayout_ {
+	HCubeDepthFirst,	// order of the recursive build
+	HCubeMortonLevels,	// level by level, each level in Morton order
+	HCubeSlabsReversed	// reversed order of a bottom-up slab build
+} HCubeLayout;
+
+
+// Mean of count xyz elements and whether all of them are within the relative
+// error or the absolute threshold of it. False if an element is a child
+// reference, the mean is then taken over the values only. Vectorized, see
+// src/HCube.cpp.
+bool collapseElements(const float* elements, size_t count, float error,
+                      float threshold, float* mean);
+
+inline bool collapseElements(const Vector3f* elements, size_t count, float error,
+                             float threshold, Vector3f& mean) {
+	return collapseElements(&elements[0].x, count, error, threshold, &mean.x);
+}
+
+// Scalar variant for the other element types, every part of the elements has
+// to pass on its own.
+template<typename T>
+bool collapseElements(const T* elements, size_t count, float error,
+                      float threshold, T& mean) {
+	typedef HCubeElement<T> traits_t;
+	bool cubes = false;
+	mean = T();
+
+	for (size_t i = 0; i < count; i++) {
+		if (traits_t::isCube(elements[i]))
+			cubes = true;
+		else
+			mean += elements[i];
+	}
+
+	mean /= count;
+
+	if (cubes)
+		return false;
+
+	for (size_t part = 0; part < traits_t::parts; part++) {
+		float max2 = 0;
+
+		for (size_t i = 0; i < count; i++)
+			max2 = std::max(max2, traits_t::length2(elements[i] - mean, part));
+
+		if (!(max2 <= error * error * traits_t::length2(mean, part))
+		        && !(max2 <= threshold * threshold))
+			return false;
+	}
+
+	return true;
+}
+
+enum HCubeFileFlags {
+	HCubeShared = 1	// subtrees may be referenced more than once
+};
+
 struct HCubeInitFlags {
-	HCubeInitFlags() : presampling(512) {
+	HCubeInitFlags() : presampling(512), parallel_levels(0), verbose(true) {
 	}
 	Vector3f offsetKpc;
 	float sizeKpc;
@@ -27,73 +131,252 @@ struct HCubeInitFlags {
 	size_t maxdepth;
 	size_t target_depth;
 	size_t presampling;
+	size_t parallel_levels;
+	bool verbose;	// progress of the top levels on stdout
+};
+
+// Header at the beginning of HCube files, the cubes follow at
+// HCubeHeader::dataOffset. Files without header start with the root cube.
+struct HCubeHeader {
+	enum {
+		version_current = 1,
+		dataOffset = 4096
+	};
+
+	char magic[8];
+	uint32_t version;
+	uint32_t n;
+	uint32_t depth;
+	uint32_t layout;
+	uint32_t flags;
+	uint32_t encoding;
+	uint64_t cubes;
+	uint64_t means;	// file offset of the subtree means, 0 if none
+	Vector3f origin;
+	float size;
+	float error;
+	float threshold;
+	uint32_t checksum;
+
+	HCubeHeader() :
+			version(0), n(0), depth(0), layout(HCubeDepthFirst), flags(0),
+			encoding(HCubeFloat), cubes(0), means(0), origin(0, 0, 0),
+			size(0), error(0), threshold(0), checksum(0) {
+		memset(magic, 0, sizeof(magic));
+	}
+
+	HCubeHeader(uint32_t n, const HCubeInitFlags& flags, uint64_t cubes,
+	            uint32_t encoding = HCubeFloat) :
+			version(version_current), n(n), depth(flags.maxdepth),
+			layout(HCubeDepthFirst), flags(0), encoding(encoding),
+			cubes(cubes), means(0), origin(flags.offsetKpc), size(flags.sizeKpc),
+			error(flags.error), threshold(flags.threshold), checksum(0) {
+		memcpy(magic, "QBHCUBE", sizeof(magic));
+		updateChecksum();
+	}
+
+	void updateChecksum() {
+		checksum = computeChecksum();
+	}
+
+	uint32_t computeChecksum() const {
+		return MurmurHash2(this, offsetof(HCubeHeader, checksum), 0);
+	}
+
+	bool valid() const {
+		return (memcmp(magic, "QBHCUBE", sizeof(magic)) == 0)
+				&& (checksum == computeChecksum());
+	}
+
+	// Reads the header of an HCube file, false for files without header.
+	static bool read(const std::string& filename, HCubeHeader& header) {
+		std::ifstream in(filename.c_str(), std::ios::binary);
+		in.read((char*) &header, sizeof(HCubeHeader));
+		return in && header.valid();
+	}
 };
 
+// Finished subcubes of a database build, for resuming. A subcube is keyed by
+// its integer position in the grid of its own size within the build region.
+// Records carry a checksum, a torn or corrupt tail is dropped on load.
+// Records are appended in batches, each followed by fdatasync. The cube data
+// set with syncBefore is synced ahead of each batch, so after a power loss or
+// kernel crash no record refers to cubes that did not reach the disk. A
+// process crash alone loses nothing written to the page cache.
 class HCubeInitCheckpoint {
-	typedef std::pair<Vector3f, float> id_t;
-	typedef std::map< id_t, size_t > map_t;
-	typedef map_t::iterator iter_t;
+public:
+	struct Record {
+		uint32_t cells, x, y, z;
+		uint64_t end;
+		uint32_t checksum;
+		uint32_t reserved;
+
+		void updateChecksum();
+		bool valid() const;
+	};
+
+private:
+	struct Key {
+		uint32_t cells, x, y, z;
+
+		bool operator ==(const Key& k) const {
+			return cells == k.cells && x == k.x && y == k.y && z == k.z;
+		}
+	};
+
+	struct KeyHash {
+		size_t operator ()(const Key& k) const {
+			return MurmurHash2(&k, sizeof(Key), 0);
+		}
+	};
+
+	typedef std::unordered_map<Key, uint64_t, KeyHash> map_t;
 	map_t indices;
 
-	std::ofstream outfile;
+	int file;
+	std::vector<Record> pending;
+	size_t batch;
+	time_t interval, synced;
+	void* sync_data;
+	size_t sync_size;
+	int sync_file;
+
+	// invalidated subcubes, still in indices
+	std::vector<Key> dropped;
+
+	static Key key(const HCubeInitFlags& flags, const Vector3f& v, float s);
+	void erase(const std::vector<Key>& keys);
+	void write();
 
 public:
 
+	HCubeInitCheckpoint(const std::string& filename, size_t batch = 4096,
+	                    time_t interval = 10);
+	~HCubeInitCheckpoint();
+
+	void init(const std::string& filename);
+
+	// Index behind the finished subcube at v with edge length s, 0 if none.
+	size_t end(const HCubeInitFlags& flags, const Vector3f& v, float s) const;
+	void done(const HCubeInitFlags& flags, const Vector3f& v, float s,
+	          size_t end);
+	// Drops the records of the subcube and everything inside it, durably.
+	// Stored as a record with end 0. end is read by the build tasks without a
+	// lock, the records stay in memory until drop.
+	void invalidate(const HCubeInitFlags& flags, const Vector3f& v, float s);
+	// Removes the invalidated records from memory, with no build tasks
+	// running.
+	void drop();
+	void flush();
+
+	// The shared mapping, or the file, the cube data is written to.
+	void syncBefore(void* data, size_t size);
+	void syncBefore(int file);
+
+	bool empty() const {
+		return indices.empty();
+	}
+};
 
-	HCubeInitCheckpoint(const std::string& filename) {
-		init(filename);
+// Dense field of n^3 elements with index (x * n + y) * n + z, read in
+// slabs of whole x planes.
+template<typename T>
+class HCubeSlabReader {
+public:
+	virtual ~HCubeSlabReader() {
 	}
 
-	void init(const std::string& filename) {
-		// load idx pairs
-		std::ifstream infile(filename.c_str(), std::ios::binary);
+	virtual size_t getN() const = 0;
 
-		while (infile.good()) {
-			Vector3f v;
-			float s;
-			size_t e;
-			infile.read((char*)&v, sizeof(Vector3f));
-			infile.read((char*)&s, sizeof(float));
-			infile.read((char*)&e, sizeof(size_t));
+	// Reads the count planes from x on, count * n * n elements.
+	virtual void read(size_t x, size_t count, T* data) = 0;
+};
 
-			if (infile) {
-				indices[std::make_pair(v, s)] = e;
-			}
-		}
+// Raw file of the elements, as written by Grid dumps. Reads the region of
+// n^3 elements at the element offset x, y, z of the dataN^3 elements.
+template<typename T>
+class HCubeRawSlabReader: public HCubeSlabReader<T> {
+	StreamingFileRead _file;
+	size_t _dataN, _n, _x, _y, _z;
+
+	void check() {
+		if (_file.size() < (off_t) (_dataN * _dataN * _dataN * sizeof(T)))
+			throw std::runtime_error("[HCubeRawSlabReader] file is smaller than the field!");
+	}
+public:
+
+	HCubeRawSlabReader(const std::string& filename, size_t dataN) :
+			_file(filename), _dataN(dataN), _n(dataN), _x(0), _y(0), _z(0) {
+		check();
+	}
+
+	HCubeRawSlabReader(const std::string& filename, size_t dataN, size_t n,
+	                   size_t x, size_t y, size_t z) :
+			_file(filename), _dataN(dataN), _n(n), _x(x), _y(y), _z(z) {
+		if (std::max(std::max(x, y), z) + n > dataN)
+			throw std::runtime_error("[HCubeRawSlabReader] region is outside of the field!");
+		check();
+	}
+
+	size_t getN() const {
+		return _n;
+	}
 
-		infile.ignore(std::numeric_limits < std::streamsize > ::max(), '\n');
-		infile.close();
+	void read(size_t x, size_t count, T* data) {
+		const size_t row = _dataN * sizeof(T);
+		const size_t plane = _dataN * row;
 
-		// truncate invalid pairs
+		if (_n == _dataN) {
+			_file.read((x + _x) * plane, data, count * plane);
+			return;
+		}
 
-		// prepare write
-		outfile.open(filename.c_str(), std::ios::app | std::ios::binary);
+		for (size_t iX = 0; iX < count; iX++)
+			for (size_t iY = 0; iY < _n; iY++)
+				_file.read((x + _x + iX) * plane + (iY + _y) * row + _z * sizeof(T),
+				           data + (iX * _n + iY) * _n, _n * sizeof(T));
 	}
+};
 
-	size_t end(const Vector3f& v, float s) {
-		iter_t i = indices.find(std::make_pair(v, s));
+// PagedGrid field, read one column of pages at a time. The grid needs to
+// hold the pages of one slab, count / pageSize + 1 pages.
+template<typename T>
+class HCubePagedGridSlabReader: public HCubeSlabReader<T> {
+	PagedGrid<T>& _grid;
+	size_t _n, _pageSize;
+public:
 
-		if (i != indices.end())
-			return i->second;
-		else
-			return 0;
+	HCubePagedGridSlabReader(PagedGrid<T>& grid, size_t n, size_t pageSize) :
+			_grid(grid), _n(n), _pageSize(pageSize) {
 	}
 
-	void done(Vector3f v, float s, size_t end) {
-		outfile.write((char*)&v, sizeof(Vector3f));
-		outfile.write((char*)&s, sizeof(float));
-		outfile.write((char*)&end, sizeof(size_t));
-		outfile.flush();
+	size_t getN() const {
+		return _n;
 	}
 
-	bool empty() {
-		return (indices.size() == 0);
+	void read(size_t x, size_t count, T* data) {
+		for (size_t pY = 0; pY < _n; pY += _pageSize)
+			for (size_t pZ = 0; pZ < _n; pZ += _pageSize)
+				for (size_t iX = 0; iX < count; iX++)
+					for (size_t iY = pY; iY < std::min(_n, pY + _pageSize); iY++)
+						for (size_t iZ = pZ; iZ < std::min(_n, pZ + _pageSize); iZ++)
+							data[(iX * _n + iY) * _n + iZ] = _grid.getReadOnly(
+									Index3(x + iX, iY, iZ));
 	}
 };
 
-template<size_t N>
+template<size_t N, typename T = Vector3f>
 class HCube {
-	Vector3f elements[N* N* N];
+	T elements[N* N* N];
+
+	typedef HCubeElement<T> traits_t;
+
+	// deposits the particle quantity of the element type
+	static void sampleElement(const SmoothParticle& particle,
+	                          const KernelPayload* payload, float* value) {
+		const T v = traits_t::sample(particle, payload);
+		memcpy(value, &v, sizeof(T));
+	}
 
 public:
 
@@ -119,20 +402,22 @@ public:
 			}
 		} else {
 			for (size_t n = 0; n < N3; n++) {
-				if (depth == 0)
-					std::cout << "\n " << n;
-				else if (depth == 1)
-					std::cout << "." << n;
+				if (flags.verbose) {
+					if (depth == 0)
+						std::cout << "\n " << n;
+					else if (depth == 1)
+						std::cout << "." << n;
 
-				std::cout.flush();
-				HCube<N>* hc = this + (idx - thisidx);
+					std::cout.flush();
+				}
+				HCube<N, T>* hc = this + (idx - thisidx);
 				size_t i = n / N2;
 				size_t j = (n % N2) / N;
 				size_t k = n % N;
 				size_t tmpidx = idx;
 				hc->init(field, offsetKpc + Vector3f(i * s, j * s, k * s), s,
 				         depth + 1, tmpidx, flags);
-				Vector3f mean;
+				T mean;
 
 				if (hc->collapse(mean, flags.error, flags.threshold)) {
 					setValue(i, j, k, mean);
@@ -155,7 +440,7 @@ public:
 #ifdef DEBUG
 		std:: cout << "Start " << offsetKpc << ", " << sizeKpc << "." << std::endl;
 #endif
-		size_t end_idx = checkpoint.end(offsetKpc, sizeKpc);
+		size_t end_idx = checkpoint.end(flags, offsetKpc, sizeKpc);
 
 		if (end_idx) {
 #ifdef DEBUG
@@ -181,27 +466,28 @@ public:
 				n *= N;
 
 			size_t n3 = n * n * n;
-			Vector3f* data = new Vector3f[n3];
+			T* data = new T[n3];
 
 			// zero
-			::memset(data, 0, sizeof(Vector3f) * n3);
+			::memset((void*) data, 0, sizeof(T) * n3);
 
 			// create visitor
 			Vector3f lower = offsetKpc;
 			//Vector3f upper = lower + Vector3f(sizeKpc, sizeKpc, sizeKpc);
 
 			//std::cout << "Sample: " << lower << " - " << sizeKpc << std::endl;
-			SimpleSamplingVisitor v(data, n, lower, sizeKpc);
+			SimpleSamplingVisitor v((float*) data, traits_t::channels, sampleElement, n,
+			                        lower, sizeKpc);
 			//v.showProgress(true);
 
-			db->accept(v);
+			v.sample(*db);
 
 			if (v.getCount()) {
 				// call this->init with sampled data
 				init(data, n, sizeKpc, Vector3f(0, 0, 0), sizeKpc, depth, idx, flags);
 			} else {
 				// no samples, all values are zero
-				memset(this, 0, sizeof(HCube<N>));
+				memset((void*) this, 0, sizeof(HCube<N, T>));
 			}
 
 			delete[] data;
@@ -211,20 +497,22 @@ public:
 			idx++;
 
 			for (size_t n = 0; n < N3; n++) {
-				if (depth == 0)
-					std::cout << "\n " << n;
-				else if (depth == 1)
-					std::cout << "." << n;
+				if (flags.verbose) {
+					if (depth == 0)
+						std::cout << "\n " << n;
+					else if (depth == 1)
+						std::cout << "." << n;
 
-				std::cout.flush();
-				HCube<N>* hc = this + (idx - thisidx);
+					std::cout.flush();
+				}
+				HCube<N, T>* hc = this + (idx - thisidx);
 				size_t i = n / N2;
 				size_t j = (n % N2) / N;
 				size_t k = n % N;
 				size_t tmpidx = idx;
 				hc->init(db, offsetKpc + Vector3f(i * s, j * s, k * s), s,
 				         depth + 1, tmpidx, flags, checkpoint);
-				Vector3f mean;
+				T mean;
 
 				if (hc->collapse(mean, flags.error, flags.threshold) || (depth >= flags.target_depth)) {
 					setValue(i, j, k, mean);
@@ -236,14 +524,368 @@ public:
 
 		}
 
-		checkpoint.done(offsetKpc, sizeKpc, idx);
+		checkpoint.done(flags, offsetKpc, sizeKpc, idx);
 #ifdef DEBUG
 		std:: cout << "Done " << offsetKpc << ", " << sizeKpc << " -> " << idx << "." << std::endl;
 #endif
 
 	}
 
-	void init(const Vector3f* data, size_t dataN, float dataSize,
+	// Task parallel variant of init(Database*, ...), call from within an omp
+	// single region. The subcubes of the top levels are built as independent
+	// tasks, each into its own region of the mapping which is large enough
+	// for a complete subtree. Afterwards the used part of each region is moved
+	// down behind its predecessor and the child offset is set. Offsets inside
+	// a subtree are relative and stay valid. Regions depend on maxdepth and
+	// the number of parallel levels, a resumed build has to use the same.
+	void initParallel(Database* db, const Vector3f& offsetKpc, float sizeKpc,
+	                  size_t depth, size_t& idx, const HCubeInitFlags& flags,
+	                  HCubeInitCheckpoint& checkpoint, size_t levels) {
+		const size_t N3 = N * N * N;
+		const size_t N2 = N * N;
+
+		size_t desired_depth = int(log2(flags.presampling) / log2(N));
+		size_t remaining_depth = 1 + flags.maxdepth - depth;
+
+		if (levels == 0 || remaining_depth <= desired_depth) {
+			init(db, offsetKpc, sizeKpc, depth, idx, flags, checkpoint);
+			return;
+		}
+
+		size_t end_idx = checkpoint.end(flags, offsetKpc, sizeKpc);
+
+		if (end_idx) {
+			idx = end_idx;
+			return;
+		}
+
+		const float s = sizeKpc / N;
+		const size_t thisidx = idx;
+		const size_t region = regionSize(flags.maxdepth - depth - 1);
+		std::vector<size_t> ends(N3);
+		bool failed = false;
+
+		for (size_t n = 0; n < N3; n++) {
+			#pragma omp task firstprivate(n) shared(ends, checkpoint, failed)
+			{
+				size_t i = n / N2;
+				size_t j = (n % N2) / N;
+				size_t k = n % N;
+				size_t tmpidx = thisidx + 1 + n * region;
+				HCube<N, T>* hc = this + (tmpidx - thisidx);
+
+				// exceptions must not leave the task
+				try {
+					hc->initParallel(db, offsetKpc + Vector3f(i * s, j * s, k * s),
+					                 s, depth + 1, tmpidx, flags, checkpoint,
+					                 levels - 1);
+				} catch (HCubeOffsetError&) {
+					#pragma omp atomic write
+					failed = true;
+				}
+				ends[n] = tmpidx;
+
+				if (depth == 0 && flags.verbose) {
+					#pragma omp critical(HCubeProgress)
+					{
+						std::cout << " " << n;
+						std::cout.flush();
+					}
+				}
+			}
+		}
+
+		#pragma omp taskwait
+
+		if (failed)
+			throw HCubeOffsetError();
+
+		// the records inside refer to the regions, which are moved now
+		checkpoint.invalidate(flags, offsetKpc, sizeKpc);
+		idx = thisidx + 1;
+
+		for (size_t n = 0; n < N3; n++) {
+			size_t i = n / N2;
+			size_t j = (n % N2) / N;
+			size_t k = n % N;
+			size_t start = thisidx + 1 + n * region;
+			HCube<N, T>* hc = this + (start - thisidx);
+			T mean;
+
+			if (hc->collapse(mean, flags.error, flags.threshold) || (depth >= flags.target_depth)) {
+				setValue(i, j, k, mean);
+			} else {
+				if (idx != start)
+					::memmove((void*) (this + (idx - thisidx)), (const void*) hc,
+					          (ends[n] - start) * sizeof(HCube<N, T>));
+
+				setCube(i, j, k, idx - thisidx);
+				idx += ends[n] - start;
+			}
+		}
+
+		checkpoint.done(flags, offsetKpc, sizeKpc, idx);
+	}
+
+	static off_t fileOffset(size_t idx) {
+		return HCubeHeader::dataOffset + idx * sizeof(HCube<N, T>);
+	}
+
+	// Streaming variant of init(Database*, ...). Builds into cube and writes
+	// the finished subtree through out, cube itself last at its reserved
+	// index idx. Only the cubes on the current path and one sampled subtree
+	// are held in memory, the subtree with room for all regionSize cubes of
+	// its depth. A parent that collapses cube reuses its index.
+	static void stream(Database* db, const Vector3f& offsetKpc, float sizeKpc,
+	                   size_t depth, size_t& idx, const HCubeInitFlags& flags,
+	                   HCubeInitCheckpoint& checkpoint, BufferedFileWrite& out,
+	                   HCube<N, T>& cube) {
+		const size_t N3 = N * N * N;
+		const size_t N2 = N * N;
+		const size_t thisidx = idx;
+		size_t end_idx = checkpoint.end(flags, offsetKpc, sizeKpc);
+
+		if (end_idx) {
+			out.read(fileOffset(thisidx), &cube, sizeof(HCube<N, T>));
+			idx = end_idx;
+			return;
+		}
+
+		size_t desired_depth = int(log2(flags.presampling) / log2(N));
+		size_t remaining_depth = 1 + flags.maxdepth - depth;
+
+		if (remaining_depth <= desired_depth) {
+			size_t n = N;
+
+			for (size_t i = 1; i < remaining_depth; i++)
+				n *= N;
+
+			size_t n3 = n * n * n;
+			std::vector<T> data(n3, T());
+			SimpleSamplingVisitor v((float*) &data[0], traits_t::channels,
+			                        sampleElement, n, offsetKpc, sizeKpc);
+			v.sample(*db);
+
+			if (v.getCount()) {
+				// offsets inside the subtree are relative, write it as built
+				std::vector< HCube<N, T> > subtree(regionSize(flags.maxdepth - depth));
+				size_t count = 0;
+				subtree[0].init(&data[0], n, sizeKpc, Vector3f(0, 0, 0), sizeKpc,
+				                depth, count, flags);
+				cube = subtree[0];
+				out.write(fileOffset(thisidx), &subtree[0], count * sizeof(HCube<N, T>));
+				idx += count;
+			} else {
+				memset((void*) &cube, 0, sizeof(HCube<N, T>));
+				out.write(fileOffset(thisidx), &cube, sizeof(HCube<N, T>));
+				idx++;
+			}
+		} else {
+			const float s = sizeKpc / N;
+			std::vector< HCube<N, T> > child(1);
+			idx++;
+
+			for (size_t n = 0; n < N3; n++) {
+				if (flags.verbose) {
+					if (depth == 0)
+						std::cout << "\n " << n;
+					else if (depth == 1)
+						std::cout << "." << n;
+
+					std::cout.flush();
+				}
+				size_t i = n / N2;
+				size_t j = (n % N2) / N;
+				size_t k = n % N;
+				size_t tmpidx = idx;
+				stream(db, offsetKpc + Vector3f(i * s, j * s, k * s), s, depth + 1,
+				       tmpidx, flags, checkpoint, out, child[0]);
+				T mean;
+
+				if (child[0].collapse(mean, flags.error, flags.threshold) || (depth >= flags.target_depth)) {
+					cube.setValue(i, j, k, mean);
+				} else {
+					cube.setCube(i, j, k, idx - thisidx);
+					idx = tmpidx;
+				}
+			}
+
+			out.write(fileOffset(thisidx), &cube, sizeof(HCube<N, T>));
+		}
+
+		// a checkpoint must not refer to buffered cubes
+		out.flush();
+		checkpoint.done(flags, offsetKpc, sizeKpc, idx);
+	}
+
+	// Bottom-up build from a field of N^(maxdepth + 1) elements per axis,
+	// read in slabs of N planes. Per depth one layer of cubes is held, a
+	// layer is finished when its last slab is read. Finished cubes are
+	// written to out from index 0 on, children before their parents, with
+	// the child offsets of the reversed order, see reverse(). Returns the
+	// number of cubes, the root is the last one.
+	static size_t build(HCubeSlabReader<T>& in, const HCubeInitFlags& flags,
+	                    BufferedFileWrite& out) {
+		const size_t depth = flags.maxdepth;
+		std::vector<size_t> sides(depth + 1, N);
+
+		for (size_t d = 1; d <= depth; d++)
+			sides[d] = sides[d - 1] * N;
+
+		if (in.getN() != sides[depth])
+			throw std::runtime_error("[HCube] field size does not match the depth!");
+
+		// element layers, spool indices of the child references
+		std::vector< std::vector<T> > layers(depth + 1);
+		std::vector< std::vector<uint64_t> > refs(depth + 1);
+
+		for (size_t d = 0; d <= depth; d++) {
+			layers[d].resize(N * sides[d] * sides[d]);
+
+			if (d < depth)
+				refs[d].resize(layers[d].size());
+		}
+
+		const size_t n = sides[depth];
+		size_t count = 0;
+
+		for (size_t x = 0; x < n; x += N) {
+			if (flags.verbose) {
+				std::cout << "\r " << (x + N) << "/" << n;
+				std::cout.flush();
+			}
+			in.read(x, N, &layers[depth][0]);
+
+			// finish the layers this slab completes
+			size_t d = depth;
+
+			for (size_t cx = x / N;; cx /= N, d--) {
+				buildLayer(d, cx, sides, layers, refs, flags, out, count);
+
+				if (d == 0 || (cx % N) != N - 1)
+					break;
+			}
+		}
+
+		if (flags.verbose)
+			std::cout << std::endl;
+
+		return count;
+	}
+
+	// Builds the cubes of layer cx at depth d and stores their means or
+	// references in the layer of depth d - 1.
+	static void buildLayer(size_t d, size_t cx, const std::vector<size_t>& sides,
+	                       std::vector< std::vector<T> >& layers,
+	                       std::vector< std::vector<uint64_t> >& refs,
+	                       const HCubeInitFlags& flags, BufferedFileWrite& out,
+	                       size_t& count) {
+		const size_t N2 = N * N;
+		const size_t side = sides[d];
+		const size_t cubes = side / N;
+		const T* layer = &layers[d][0];
+		const uint64_t* layerRefs = refs[d].empty() ? 0 : &refs[d][0];
+		std::vector< HCube<N, T> > row(cubes);
+		std::vector<T> means(cubes);
+		std::vector<size_t> indices(cubes);
+
+		for (size_t cy = 0; cy < cubes; cy++) {
+			#pragma omp parallel for schedule(static)
+			for (size_t cz = 0; cz < cubes; cz++) {
+				HCube<N, T>& cube = row[cz];
+
+				for (size_t i = 0; i < N; i++)
+					for (size_t j = 0; j < N; j++)
+						memcpy((void*) &cube.elements[i * N2 + j * N],
+						       layer + (i * side + cy * N + j) * side + cz * N,
+						       N * sizeof(T));
+
+				// the root is kept, like in init
+				bool collapsed = cube.collapse(means[cz], flags.error, flags.threshold);
+				indices[cz] = (d > 0 && (collapsed || d > flags.target_depth)) ? 0 : 1;
+			}
+
+			for (size_t cz = 0; cz < cubes; cz++) {
+				if (indices[cz])
+					indices[cz] = ++count;
+			}
+
+			// the offsets below are less than count, set in parallel
+			if (count > traits_t::maxOffset)
+				throw HCubeOffsetError();
+
+			if (layerRefs) {
+				#pragma omp parallel for schedule(static)
+				for (size_t cz = 0; cz < cubes; cz++) {
+					if (!indices[cz])
+						continue;
+
+					for (size_t i = 0; i < N; i++)
+						for (size_t j = 0; j < N; j++)
+							for (size_t k = 0; k < N; k++) {
+								T& e = row[cz].elements[i * N2 + j * N + k];
+
+								if (traits_t::isCube(e))
+									traits_t::setCube(e, indices[cz] - layerRefs[(i
+											* side + cy * N + j) * side + cz * N + k]);
+							}
+				}
+			}
+
+			for (size_t cz = 0; cz < cubes; cz++) {
+				if (indices[cz])
+					out.write(fileOffset(indices[cz] - 1), &row[cz],
+					          sizeof(HCube<N, T>));
+			}
+
+			if (d == 0)
+				break;
+
+			const size_t parentSide = sides[d - 1];
+
+			for (size_t cz = 0; cz < cubes; cz++) {
+				size_t p = ((cx % N) * parentSide + cy) * parentSide + cz;
+
+				if (indices[cz]) {
+					traits_t::setCube(layers[d - 1][p], 1);
+					refs[d - 1][p] = indices[cz];
+				} else {
+					layers[d - 1][p] = means[cz];
+				}
+			}
+		}
+	}
+
+	// Reverses the order of the first count cubes of out in place, chunk
+	// cubes at a time.
+	static void reverse(BufferedFileWrite& out, size_t count, size_t chunk) {
+		std::vector< HCube<N, T> > lower(chunk), upper(chunk);
+		size_t begin = 0, end = count;
+
+		while (end - begin >= 2 * chunk) {
+			const size_t bytes = chunk * sizeof(HCube<N, T>);
+			out.read(fileOffset(begin), &lower[0], bytes);
+			out.read(fileOffset(end - chunk), &upper[0], bytes);
+			std::reverse(lower.begin(), lower.end());
+			std::reverse(upper.begin(), upper.end());
+			out.write(fileOffset(begin), &upper[0], bytes);
+			out.write(fileOffset(end - chunk), &lower[0], bytes);
+			begin += chunk;
+			end -= chunk;
+		}
+
+		if (end > begin) {
+			const size_t bytes = (end - begin) * sizeof(HCube<N, T>);
+			lower.resize(end - begin);
+			out.read(fileOffset(begin), &lower[0], bytes);
+			std::reverse(lower.begin(), lower.end());
+			out.write(fileOffset(begin), &lower[0], bytes);
+		}
+
+		out.flush();
+	}
+
+	void init(const T* data, size_t dataN, float dataSize,
 	          const Vector3f& offsetKpc, float sizeKpc, size_t depth, size_t& idx, const HCubeInitFlags& flags) {
 		const float s = sizeKpc / N;
 		const size_t N3 = N * N * N;
@@ -271,14 +913,14 @@ public:
 		} else {
 
 			for (size_t n = 0; n < N3; n++) {
-				HCube<N>* hc = this + (idx - thisidx);
+				HCube<N, T>* hc = this + (idx - thisidx);
 				size_t i = n / N2;
 				size_t j = (n % N2) / N;
 				size_t k = n % N;
 				size_t tmpidx = idx;
 				hc->init(data, dataN, dataSize,
 				         offsetKpc + Vector3f(i * s, j * s, k * s), s, depth + 1, tmpidx, flags);
-				Vector3f mean;
+				T mean;
 
 				if (hc->collapse(mean, flags.error, flags.threshold) || (depth >= flags.target_depth)) {
 					setValue(i, j, k, mean);
@@ -291,7 +933,7 @@ public:
 		}
 	}
 
-	void init(const std::vector< const HCube<N> * >& srcs, size_t& idx, const HCubeInitFlags& flags, size_t levels = 0) {
+	void init(const std::vector< const HCube<N, T> * >& srcs, size_t& idx, const HCubeInitFlags& flags, size_t levels = 0) {
 		const size_t N2 = N * N;
 		const size_t N3 = N2 * N;
 		const size_t thisidx = idx;
@@ -304,20 +946,20 @@ public:
 
 		for (size_t n = 0; n < N3; n++) {
 
-			HCube<N>* hc = this + (idx - thisidx);
+			HCube<N, T>* hc = this + (idx - thisidx);
 			size_t tmpidx = idx;
 
 			if (levels == 0) {
 				size_t count = srcs[n]->getCubeCount();
-				memcpy(hc, srcs[n], count * sizeof(HCube<N>));
+				memcpy((void*) hc, (const void*) srcs[n], count * sizeof(HCube<N, T>));
 				tmpidx += count;
 			} else {
 				const size_t Nl = pow(N3, levels);
-				std::vector< const HCube<N> * > s(srcs.data() + n * Nl, srcs.data() + (n + 1)*Nl);
+				std::vector< const HCube<N, T> * > s(srcs.data() + n * Nl, srcs.data() + (n + 1)*Nl);
 				hc->init(s, tmpidx, flags, levels - 1);
 			}
 
-			Vector3f mean;
+			T mean;
 
 			size_t i = n / N2;
 			size_t j = (n % N2) / N;
@@ -332,39 +974,149 @@ public:
 
 	}
 
-	void load(std::istream& in, size_t dataN, float dataSize,
-	          const Vector3f& offsetKpc, float sizeKpc, float threshold) {
-		const float s = sizeKpc / N;
-		const size_t N3 = N * N * N;
+	// Layout of init(srcs, ...) without copying the pieces. The levels above
+	// the pieces are built into cube and appended to upper with their index,
+	// kept pieces of counts[i] cubes get their index in placement, others
+	// keep invalid. Pieces are srcs[first] to srcs[first + N3^(levels+1)].
+	static void planMerge(const std::vector< const HCube<N, T> * >& srcs,
+	                      const std::vector<size_t>& counts, size_t first,
+	                      size_t levels, size_t& idx, const HCubeInitFlags& flags,
+	                      HCube<N, T>& cube, std::vector<size_t>& placement,
+	                      std::vector<size_t>& upperIdx,
+	                      std::vector< HCube<N, T> >& upper, size_t invalid) {
 		const size_t N2 = N * N;
+		const size_t N3 = N2 * N;
+		const size_t Nl = pow(N3, levels);
+		const size_t thisidx = idx;
+		std::vector< HCube<N, T> > child(levels ? 1 : 0);
+		idx++;
 
-		float dataStep = dataSize / dataN;
-		size_t oX = offsetKpc.x / dataStep;
-		size_t oY = offsetKpc.y / dataStep;
-		size_t oZ = offsetKpc.z / dataStep;
-		const size_t dataN2 = dataN * dataN;
+		for (size_t n = 0; n < N3; n++) {
+			const size_t piece = first + n * Nl;
+			const size_t mark = upper.size();
+			const HCube<N, T>* hc;
+			size_t tmpidx = idx;
 
-		for (size_t iX = 0; iX < N; iX++) {
-			for (size_t iY = 0; iY < N; iY++) {
-				size_t offsetN = (iX + oX) * dataN2 + (iY + oY) * dataN + oZ;
-				in.seekg(offsetN * sizeof(Vector3f), std::ios::beg);
-				in.read((char*)(elements + (iX * N2 + iY * N)),
-				        N * sizeof(Vector3f));
+			if (levels == 0) {
+				hc = srcs[piece];
+				tmpidx += counts[piece];
+			} else {
+				planMerge(srcs, counts, piece, levels - 1, tmpidx, flags, child[0],
+				          placement, upperIdx, upper, invalid);
+				hc = &child[0];
 			}
-		}
 
-//		const float t2 = threshold * threshold;
-//		for (size_t n = 0; n < N3; n++) {
-//			if (elements[n].length2() < t2)
-//				elements[n] = Vector3f(0, 0, 0);
-//		}
-	}
+			T mean;
+			size_t i = n / N2;
+			size_t j = (n % N2) / N;
+			size_t k = n % N;
 
-	void init(std::istream& in, size_t dataN, float dataSize,
-	          const Vector3f& offsetKpc, float sizeKpc, size_t depth, size_t& idx, const HCubeInitFlags& flags) {
-		const float s = sizeKpc / N;
-		const size_t N3 = N * N * N;
-		const size_t N2 = N * N;
+			if (hc->collapse(mean, flags.error, flags.threshold) || (levels >= flags.target_depth)) {
+				cube.setValue(i, j, k, mean);
+
+				// the indices are reused by the next sibling
+				std::fill(placement.begin() + piece, placement.begin() + piece + Nl,
+				          invalid);
+				upper.resize(mark);
+				upperIdx.resize(mark);
+			} else {
+				cube.setCube(i, j, k, idx - thisidx);
+
+				if (levels == 0)
+					placement[piece] = idx;
+
+				idx = tmpidx;
+			}
+		}
+
+		upperIdx.push_back(thisidx);
+		upper.push_back(cube);
+	}
+
+	// True if every child offset of the count cubes points forward and stays
+	// within them.
+	static bool verify(const HCube<N, T>* cubes, size_t count) {
+		const size_t N3 = N * N * N;
+
+		for (size_t i = 0; i < count; i++) {
+			for (size_t n = 0; n < N3; n++) {
+				const T& e = cubes[i].elements[n];
+
+				if (!isCube(e))
+					continue;
+
+				const uint64_t offset = toOffset(e);
+
+				if (offset == 0 || offset >= count - i)
+					return false;
+			}
+		}
+
+		return true;
+	}
+
+	// Rebuilds the tree at src into this cube bottom up, collapsing subcubes
+	// again with the error and threshold of flags.
+	void recompress(const HCube<N, T>* src, size_t& idx, const HCubeInitFlags& flags) {
+		const size_t N3 = N * N * N;
+		const size_t thisidx = idx;
+		idx++;
+
+		for (size_t n = 0; n < N3; n++) {
+			const T& e = src->elements[n];
+
+			if (!isCube(e)) {
+				elements[n] = e;
+				continue;
+			}
+
+			HCube<N, T>* hc = this + (idx - thisidx);
+			size_t tmpidx = idx;
+			hc->recompress(src->toCube(e), tmpidx, flags);
+			T mean;
+
+			if (hc->collapse(mean, flags.error, flags.threshold)) {
+				elements[n] = mean;
+			} else {
+				setCube(elements[n], idx - thisidx);
+				idx = tmpidx;
+			}
+		}
+	}
+
+	void load(std::istream& in, size_t dataN, float dataSize,
+	          const Vector3f& offsetKpc, float sizeKpc, float threshold) {
+		const float s = sizeKpc / N;
+		const size_t N3 = N * N * N;
+		const size_t N2 = N * N;
+
+		float dataStep = dataSize / dataN;
+		size_t oX = offsetKpc.x / dataStep;
+		size_t oY = offsetKpc.y / dataStep;
+		size_t oZ = offsetKpc.z / dataStep;
+		const size_t dataN2 = dataN * dataN;
+
+		for (size_t iX = 0; iX < N; iX++) {
+			for (size_t iY = 0; iY < N; iY++) {
+				size_t offsetN = (iX + oX) * dataN2 + (iY + oY) * dataN + oZ;
+				in.seekg(offsetN * sizeof(Vector3f), std::ios::beg);
+				in.read((char*)(elements + (iX * N2 + iY * N)),
+				        N * sizeof(Vector3f));
+			}
+		}
+
+//		const float t2 = threshold * threshold;
+//		for (size_t n = 0; n < N3; n++) {
+//			if (elements[n].length2() < t2)
+//				elements[n] = Vector3f(0, 0, 0);
+//		}
+	}
+
+	void init(std::istream& in, size_t dataN, float dataSize,
+	          const Vector3f& offsetKpc, float sizeKpc, size_t depth, size_t& idx, const HCubeInitFlags& flags) {
+		const float s = sizeKpc / N;
+		const size_t N3 = N * N * N;
+		const size_t N2 = N * N;
 		size_t thisidx = idx;
 		idx++;
 
@@ -385,14 +1137,14 @@ public:
 					}
 				}
 
-				HCube<N>* hc = this + (idx - thisidx);
+				HCube<N, T>* hc = this + (idx - thisidx);
 				size_t i = n / N2;
 				size_t j = (n % N2) / N;
 				size_t k = n % N;
 				size_t tmpidx = idx;
 				hc->init(in, dataN, dataSize,
 				         offsetKpc + Vector3f(i * s, j * s, k * s), s, depth + 1, tmpidx, flags);
-				Vector3f mean;
+				T mean;
 
 				if (hc->collapse(mean, flags.error, flags.threshold)) {
 					setValue(i, j, k, mean);
@@ -408,14 +1160,14 @@ public:
 		}
 	}
 #if 0
-	static void create(HCube<N>& hc, std::ostream& out, std::istream& in,
+	static void create(HCube<N, T>& hc, std::ostream& out, std::istream& in,
 	                   size_t dataN, float dataSize, const Vector3f& offsetKpc,
 	                   float sizeKpc, float error, float threshold, size_t maxdepth,
 	                   size_t depth, size_t& idx) {
 		const float s = sizeKpc / N;
 		const size_t N3 = N * N * N;
 		const size_t N2 = N * N;
-		HCube<N> thishc;
+		HCube<N, T> thishc;
 		size_t thisidx = idx;
 		idx++;
 
@@ -438,17 +1190,17 @@ public:
 			size_t k = n % N;
 
 			if (depth == (maxdepth - 1)) {
-				HCube<N> hc; //  = this + (idx - thisidx)
+				HCube<N, T> hc; //  = this + (idx - thisidx)
 				hc.load(in, dataN, dataSize,
 				        offsetKpc + Vector3f(i * s, j * s, k * s), s,
 				        threshold);
-				Vector3f mean;
+				T mean;
 
 				if (hc.collapse(mean, error)) {
 					thishc.setValue(i, j, k, mean);
 				} else {
-					out.seekp(idx * sizeof(HCube<N>), std::ios::beg);
-					out.write((char*) &hc, sizeof(HCube<N>));
+					out.seekp(idx * sizeof(HCube<N, T>), std::ios::beg);
+					out.write((char*) &hc, sizeof(HCube<N, T>));
 					thishc.setCube(i, j, k, idx - thisidx);
 					idx++;
 				}
@@ -459,8 +1211,8 @@ public:
 		}
 
 		if (depth == 0) {
-			out.seekp(thisidx * sizeof(HCube<N>), std::ios::beg);
-			out.write((char*) &thishc, sizeof(HCube<N>));
+			out.seekp(thisidx * sizeof(HCube<N, T>), std::ios::beg);
+			out.write((char*) &thishc, sizeof(HCube<N, T>));
 		}
 
 		if (depth == 1) {
@@ -469,7 +1221,7 @@ public:
 
 	}
 #endif
-	static void create(HCube<N>& thishc, std::ostream& out, std::istream& in,
+	static void create(HCube<N, T>& thishc, std::ostream& out, std::istream& in,
 	                   size_t dataN, float dataSize, const Vector3f& offsetKpc,
 	                   float sizeKpc, float error, float threshold, size_t maxdepth,
 	                   size_t depth, size_t& idx) {
@@ -495,7 +1247,7 @@ public:
 			size_t i = n / N2;
 			size_t j = (n % N2) / N;
 			size_t k = n % N;
-			HCube<N> hc;
+			HCube<N, T> hc;
 			size_t tmpidx = idx + 1;
 			size_t nextidx = tmpidx;
 			Vector3f subOffsetKpc = offsetKpc + Vector3f(i * s, j * s, k * s);
@@ -507,14 +1259,15 @@ public:
 				       threshold, maxdepth, depth + 1, tmpidx);
 			}
 
-			Vector3f mean;
+			T mean;
 
 			if (hc.collapse(mean, error, threshold)) {
 				thishc.setValue(i, j, k, mean);
 			} else {
 				idx = tmpidx;
-				out.seekp(nextidx * sizeof(HCube<N>), std::ios::beg);
-				out.write((char*) &hc, sizeof(HCube<N>));
+				out.seekp(HCubeHeader::dataOffset + nextidx * sizeof(HCube<N, T>),
+				          std::ios::beg);
+				out.write((char*) &hc, sizeof(HCube<N, T>));
 				thishc.setCube(i, j, k, nextidx - thisidx);
 			}
 		}
@@ -529,293 +1282,927 @@ public:
 	                   float dataSize, const Vector3f& offsetKpc, float sizeKpc,
 	                   float error, float threshold, size_t maxdepth) {
 		size_t idx = 0;
-		HCube<N> hc;
+		HCube<N, T> hc;
 		create(hc, out, in, dataN, dataSize, offsetKpc, sizeKpc, error,
 		       threshold, maxdepth, 0, idx);
+		out.seekp(HCubeHeader::dataOffset, std::ios::beg);
+		out.write((char*) &hc, sizeof(HCube<N, T>));
+
+		HCubeInitFlags flags;
+		flags.offsetKpc = offsetKpc;
+		flags.sizeKpc = sizeKpc;
+		flags.error = error;
+		flags.threshold = threshold;
+		flags.maxdepth = maxdepth;
+		HCubeHeader header(N, flags, idx + 1);
 		out.seekp(0, std::ios::beg);
-		out.write((char*) &hc, sizeof(HCube<N>));
+		out.write((char*) &header, sizeof(HCubeHeader));
 	}
 
 	size_t getN() {
 		return N;
 	}
 
-	Vector3f& at(size_t i, size_t j, size_t k) {
+	T& at(size_t i, size_t j, size_t k) {
 		return elements[i * N * N + j * N + k];
 	}
 
-	const Vector3f& at(size_t i, size_t j, size_t k) const {
+	const T& at(size_t i, size_t j, size_t k) const {
 		return elements[i * N * N + j * N + k];
 	}
 
-	void setValue(size_t i, size_t j, size_t k, const Vector3f& f) {
+	void setValue(size_t i, size_t j, size_t k, const T& f) {
 		at(i, j, k) = f;
 	}
 
-	static bool isCube(const Vector3f& v) {
-		return (v.x != v.x);
+	static bool isCube(const T& v) {
+		return traits_t::isCube(v);
 	}
 
-	HCube<N>* toCube(const Vector3f& v) {
-		uint32_t* a = (uint32_t*) &v.y;
-		uint32_t* b = (uint32_t*) &v.z;
-		uint64_t c = (uint64_t) * a | (uint64_t)(*b) << 32;
-		HCube<N>* h = this;
-		return (h + c);
+	HCube<N, T>* toCube(const T& v) {
+		return this + traits_t::toOffset(v);
 	}
 
-	const HCube<N>* toCube(const Vector3f& v) const {
-		uint32_t* a = (uint32_t*) &v.y;
-		uint32_t* b = (uint32_t*) &v.z;
-		uint64_t c = (uint64_t) * a | (uint64_t)(*b) << 32;
-		const HCube<N>* h = this;
-		return (h + c);
+	const HCube<N, T>* toCube(const T& v) const {
+		return this + traits_t::toOffset(v);
 	}
 
-	bool collapse(Vector3f& mean, float error, float threshold) {
+	static uint64_t toOffset(const T& v) {
+		return traits_t::toOffset(v);
+	}
+
+	// Coordinates of the m-th child in Morton order, N must be a power of two.
+	static void mortonIndex(size_t m, size_t& i, size_t& j, size_t& k) {
+		i = j = k = 0;
+
+		for (size_t bit = 1; bit < N; bit <<= 1) {
+			k |= (m & 1) ? bit : 0;
+			j |= (m & 2) ? bit : 0;
+			i |= (m & 4) ? bit : 0;
+			m >>= 3;
+		}
+	}
+
+	// Copies the count cubes at src into dst level by level, with the
+	// children of each cube in Morton order. Spatial neighbours of a level end
+	// up close to each other in memory. Shared subtrees are placed on the
+	// level of their longest path from the root, after all their parents.
+	// Returns the number of cubes reachable from the root.
+	static size_t repack(const HCube<N, T>* src, size_t count, HCube<N, T>* dst) {
 		const size_t N3 = N * N * N;
-		mean = Vector3f(0, 0, 0);
 
-		for (size_t i = 0; i < N3; i++) {
-			if (isCube(elements[i]))
-				return false;
+		// source references are forward, so index order visits parents first
+		std::vector<uint32_t> level(count, 0);
 
-			mean += elements[i];
+		for (size_t s = 0; s < count; s++) {
+			for (size_t c = 0; c < N3; c++) {
+				const T& e = src[s].elements[c];
+
+				if (isCube(e)) {
+					uint32_t& l = level[s + toOffset(e)];
+					l = std::max(l, level[s] + 1);
+				}
+			}
 		}
 
-		mean /= N3;
+		std::vector<uint64_t> index(count, 0);
+		std::vector<uint64_t> order;
+		order.reserve(count);
+		order.push_back(0);
+
+		for (size_t q = 0; q < order.size(); q++) {
+			const HCube<N, T>& cube = src[order[q]];
+
+			for (size_t m = 0; m < N3; m++) {
+				size_t i, j, k;
+				mortonIndex(m, i, j, k);
+				const T& e = cube.at(i, j, k);
+
+				if (!isCube(e))
+					continue;
 
-		const float t2 = threshold * threshold;
-		const float e2 = error * error * mean.length2();
-		bool collapseByError = true;
-		bool collapseByThreshold = true;
+				const uint64_t c = order[q] + toOffset(e);
 
-		for (size_t i = 0; i < N3; i++) {
-			float d2 = (elements[i] - mean).length2();
+				if (level[c] == level[order[q]] + 1 && index[c] == 0) {
+					index[c] = order.size();
+					order.push_back(c);
+				}
+			}
+		}
 
-			if (d2 > e2)
-				collapseByError = false;
+		for (size_t q = 0; q < order.size(); q++) {
+			dst[q] = src[order[q]];
 
-			if (d2 > t2)
-				collapseByThreshold = false;
+			for (size_t c = 0; c < N3; c++) {
+				T& e = dst[q].elements[c];
 
-			if (!collapseByThreshold && !collapseByError)
-				return false;
+				if (isCube(e))
+					setCube(e, index[order[q] + toOffset(e)] - q);
+			}
 		}
 
-		return (collapseByThreshold || collapseByError);
+		return order.size();
+	}
+
+	typedef std::unordered_multimap<uint32_t, uint64_t> dedup_index_t;
+
+	// Canonical id of the subtree at src[s]. Child references of the canonical
+	// cube hold the ids of the children. Unique cubes are written to
+	// dst[count - 1 - id], children get smaller ids than their parents so
+	// all references point forward.
+	static uint64_t deduplicate(const HCube<N, T>* src, size_t s, HCube<N, T>* dst,
+	                            size_t count, uint64_t& unique,
+	                            std::vector<uint64_t>& ids, dedup_index_t& index) {
+		const size_t N3 = N * N * N;
+
+		if (ids[s] != count)
+			return ids[s];
+
+		HCube<N, T> canonical = src[s];
+
+		for (size_t c = 0; c < N3; c++) {
+			T& e = canonical.elements[c];
+
+			if (isCube(e))
+				setCube(e, deduplicate(src, s + toOffset(e), dst, count, unique,
+				                       ids, index));
+		}
+
+		const uint32_t hash = MurmurHash2(&canonical, sizeof(HCube<N, T>), 0);
+		std::pair<dedup_index_t::iterator, dedup_index_t::iterator> range =
+		    index.equal_range(hash);
+
+		for (dedup_index_t::iterator it = range.first; it != range.second; it++) {
+			const uint64_t id = it->second;
+			const HCube<N, T>& stored = dst[count - 1 - id];
+			bool equal = true;
+
+			for (size_t c = 0; c < N3 && equal; c++) {
+				const T& a = canonical.elements[c];
+				const T& b = stored.elements[c];
+
+				if (isCube(a) && isCube(b))
+					equal = (toOffset(a) == id - toOffset(b));
+				else
+					equal = (memcmp(&a, &b, sizeof(T)) == 0);
+			}
+
+			if (equal)
+				return ids[s] = id;
+		}
+
+		const uint64_t id = unique++;
+		HCube<N, T>& stored = dst[count - 1 - id];
+		stored = canonical;
+
+		for (size_t c = 0; c < N3; c++) {
+			T& e = stored.elements[c];
+
+			if (isCube(e))
+				setCube(e, id - toOffset(e));
+		}
+
+		index.insert(std::make_pair(hash, id));
+		return ids[s] = id;
+	}
+
+	// Copies the count cubes at src into dst with equal subtrees stored once.
+	// Returns the number of unique cubes at the start of dst.
+	static size_t deduplicate(const HCube<N, T>* src, size_t count, HCube<N, T>* dst) {
+		std::vector<uint64_t> ids(count, count);
+		dedup_index_t index;
+		uint64_t unique = 0;
+		deduplicate(src, 0, dst, count, unique, ids, index);
+		memmove((void*) dst, (const void*) (dst + count - unique),
+		        unique * sizeof(HCube<N, T>));
+		return unique;
+	}
+
+	bool collapse(T& mean, float error, float threshold) const {
+		return collapseElements(elements, N * N * N, error, threshold, mean);
 	}
 
 	void setCube(size_t i, size_t j, size_t k, uint64_t cube) {
 		setCube(at(i, j, k), cube);
 	}
 
-	static void setCube(Vector3f& v, uint64_t cube) {
-		v.x = std::numeric_limits<float>::quiet_NaN();
-		uint32_t* a = (uint32_t*) &v.y;
-		*a = (cube & 0xffffffff);
-		uint32_t* b = (uint32_t*) &v.z;
-		*b = (cube >> 32 & 0xffffffff);
+	static void setCube(T& v, uint64_t cube) {
+		traits_t::setCube(v, cube);
 	}
 
-	const Vector3f& getValue(const Vector3f& position, float size) const {
-		float s = size / N;
-		size_t i = position.x / s;
-		size_t j = position.y / s;
-		size_t k = position.z / s;
-
-		if (i >= N) {
+	// Iterative descent to the element containing position. Positions are
+	// scaled to cell units once, child indices are then found by truncation
+	// and the position in the child by subtracting the index and rescaling.
+	HCubeStatus lookup(const Vector3f& position, float size,
+	                   const T*& value, size_t& depth) const {
+		const float scale = N / size;
+		float u = position.x * scale;
+		float v = position.y * scale;
+		float w = position.z * scale;
+
+		if (!(u >= 0 && u < N && v >= 0 && v < N && w >= 0 && w < N)) {
 #ifdef DEBUG
-			std::cout << "invalid i: " << i << " x:" << position.x << " size: "
-			          << size << std::endl;
+			std::cout << "invalid position: " << position << " size: " << size
+			          << std::endl;
 #endif
-			throw invalid_position();
+			return HCubeInvalidPosition;
 		}
 
-		if (j >= N) {
-#ifdef DEBUG
-			std::cout << "invalid j: " << j << " y:" << position.y << " size: "
-			          << size << std::endl;
-#endif
-			throw invalid_position();
+		const HCube<N, T>* cube = this;
+		depth = 0;
+
+		while (true) {
+			int i = std::min((int) u, (int) N - 1);
+			int j = std::min((int) v, (int) N - 1);
+			int k = std::min((int) w, (int) N - 1);
+			const T& e = cube->at(i, j, k);
+
+			if (!isCube(e)) {
+				value = &e;
+				return HCubeValid;
+			}
+
+			cube = cube->toCube(e);
+			u = (u - i) * N;
+			v = (v - j) * N;
+			w = (w - k) * N;
+			depth++;
+		}
+	}
+
+	// lookup that also returns the box of the cell found, in the coordinates
+	// position * (N / size) the cells are chosen with. Positions whose
+	// coordinates are inside [lower, upper) find the same cell.
+	HCubeStatus lookup(const Vector3f& position, float size,
+	                   const T*& value, Vector3f& lower,
+	                   Vector3f& upper) const {
+		const float scale = N / size;
+		float u = position.x * scale;
+		float v = position.y * scale;
+		float w = position.z * scale;
+
+		if (!(u >= 0 && u < N && v >= 0 && v < N && w >= 0 && w < N))
+			return HCubeInvalidPosition;
+
+		const HCube<N, T>* cube = this;
+		float h = N, x = 0, y = 0, z = 0;
+
+		while (true) {
+			int i = std::min((int) u, (int) N - 1);
+			int j = std::min((int) v, (int) N - 1);
+			int k = std::min((int) w, (int) N - 1);
+			const T& e = cube->at(i, j, k);
+			h /= N;
+			x += i * h;
+			y += j * h;
+			z += k * h;
+
+			if (!isCube(e)) {
+				value = &e;
+				lower = Vector3f(x, y, z);
+				upper = Vector3f(x + h, y + h, z + h);
+				return HCubeValid;
+			}
+
+			cube = cube->toCube(e);
+			u = (u - i) * N;
+			v = (v - j) * N;
+			w = (w - k) * N;
 		}
+	}
 
-		if (k >= N) {
-#ifdef DEBUG
-			std::cout << "invalid k: " << k << " z:" << position.z << " size: "
-			          << size << std::endl;
-#endif
-			throw invalid_position();
+	// Leaf containing position, positions on cell faces are resolved towards
+	// direction. Returns the value and the box of the leaf relative to this
+	// cube. position must be inside [0, size].
+	const T* lookup(const double* position, const double* direction,
+	                       double size, double* lower, double* upper) const {
+		const HCube<N, T>* cube = this;
+		double u[3], h = size;
+
+		for (size_t a = 0; a < 3; a++) {
+			u[a] = position[a] * N / size;
+			lower[a] = 0;
 		}
 
-		const Vector3f& v = at(i, j, k);
+		while (true) {
+			int c[3];
+			h /= N;
 
-		if (isCube(v)) {
-			const HCube* c = toCube(v);
-			return c->getValue(position - Vector3f(i * s, j * s, k * s), s);
-		} else {
-			return v;
+			for (size_t a = 0; a < 3; a++) {
+				c[a] = (direction[a] < 0) ? (int) ceil(u[a]) - 1 : (int) floor(u[a]);
+				c[a] = std::min(std::max(c[a], 0), (int) N - 1);
+				lower[a] += c[a] * h;
+			}
+
+			const T& e = cube->at(c[0], c[1], c[2]);
+
+			if (!isCube(e)) {
+				for (size_t a = 0; a < 3; a++)
+					upper[a] = lower[a] + h;
+
+				return &e;
+			}
+
+			cube = cube->toCube(e);
+
+			for (size_t a = 0; a < 3; a++)
+				u[a] = (u[a] - c[a]) * N;
 		}
 	}
 
-	size_t getDepth(const Vector3f& position, float size,
-	                size_t depth = 0) const {
-		const float s = size / N;
-		size_t i = position.x / s;
-		size_t j = position.y / s;
-		size_t k = position.z / s;
+	// Integrates the field along the ray start + t * direction, t in
+	// [0, length], stepping from cell face to cell face. integral is the
+	// integral of the field vector over the path, pathLength the length of the
+	// ray inside the cube. Returns HCubeInvalidPosition if the ray misses.
+	HCubeStatus integrate(const Vector3f& start, const Vector3f& direction,
+	                      float length, float size, Vector3f& integral,
+	                      float& pathLength) const {
+		integral = Vector3f(0, 0, 0);
+		pathLength = 0;
+
+		const double norm = sqrt(double(direction.x) * direction.x
+		                         + double(direction.y) * direction.y
+		                         + double(direction.z) * direction.z);
+
+		if (!(norm > 0))
+			return HCubeInvalidPosition;
+
+		const double s[3] = { start.x, start.y, start.z };
+		const double d[3] = { direction.x / norm, direction.y / norm,
+		                      direction.z / norm };
+
+		// clip to the cube
+		double t0 = 0, t1 = length;
+
+		for (size_t a = 0; a < 3; a++) {
+			if (d[a] == 0) {
+				if (s[a] < 0 || s[a] >= size)
+					return HCubeInvalidPosition;
+			} else {
+				const double ta = (0 - s[a]) / d[a];
+				const double tb = (size - s[a]) / d[a];
+				t0 = std::max(t0, std::min(ta, tb));
+				t1 = std::min(t1, std::max(ta, tb));
+			}
+		}
 
-		if (i >= N) {
-#ifdef DEBUG
-			std::cout << "invalid i: " << i << " x:" << position.x << " size: "
-			          << size << std::endl;
-#endif
-			throw invalid_position();
+		if (!(t0 < t1))
+			return HCubeInvalidPosition;
+
+		// least advance, for positions that round back into the last cell
+		const double epsilon = 1e-9 * size;
+		double sum[3] = { 0, 0, 0 };
+		double t = t0;
+
+		while (t < t1) {
+			double p[3], lower[3], upper[3];
+
+			for (size_t a = 0; a < 3; a++)
+				p[a] = std::min(std::max(s[a] + d[a] * t, 0.), (double) size);
+
+			const Vector3f& e = *lookup(p, d, size, lower, upper);
+			double exit = t1;
+
+			for (size_t a = 0; a < 3; a++) {
+				if (d[a] > 0)
+					exit = std::min(exit, (upper[a] - s[a]) / d[a]);
+				else if (d[a] < 0)
+					exit = std::min(exit, (lower[a] - s[a]) / d[a]);
+			}
+
+			exit = std::min(std::max(exit, t + epsilon), t1);
+			sum[0] += e.x * (exit - t);
+			sum[1] += e.y * (exit - t);
+			sum[2] += e.z * (exit - t);
+			t = exit;
 		}
 
-		if (j >= N) {
-#ifdef DEBUG
-			std::cout << "invalid j: " << j << " y:" << position.y << " size: "
-			          << size << std::endl;
-#endif
+		integral = Vector3f(sum[0], sum[1], sum[2]);
+		pathLength = t1 - t0;
+		return HCubeValid;
+	}
+
+	// Integrates n rays in parallel. Returns false if a ray missed the cube.
+	bool integrate(const Vector3f* start, const Vector3f* direction,
+	               const float* length, size_t n, float size,
+	               Vector3f* integral, float* pathLength) const {
+		bool valid = true;
+
+		#pragma omp parallel for schedule(dynamic, 64) reduction(&&:valid)
+		for (long i = 0; i < (long) n; i++)
+			valid = (integrate(start[i], direction[i], length[i], size,
+			                   integral[i], pathLength[i]) == HCubeValid) && valid;
+
+		return valid;
+	}
+
+	HCubeStatus getValue(const Vector3f& position, float size,
+	                     T& value) const {
+		const T* v;
+		size_t depth;
+		HCubeStatus status = lookup(position, size, v, depth);
+
+		if (status == HCubeValid)
+			value = *v;
+		else
+			value = T();
+
+		return status;
+	}
+
+	const T& getValue(const Vector3f& position, float size) const {
+		const T* v;
+		size_t depth;
+
+		if (lookup(position, size, v, depth) != HCubeValid)
 			throw invalid_position();
+
+		return *v;
+	}
+
+	// Fills grid with the values at its voxel centers for the cubic region at
+	// origin with edge length regionSize, relative to this cube of edge length
+	// size. The resolution is the number of bins of grid. The tree is walked
+	// once per x slab, cells covering several voxels become block fills.
+	HCubeStatus extract(Grid<T>& grid, const Vector3f& origin,
+	                    float regionSize, float size) const {
+		if (!(origin.x >= 0 && origin.y >= 0 && origin.z >= 0
+		        && origin.x + regionSize <= size && origin.y + regionSize <= size
+		        && origin.z + regionSize <= size && regionSize > 0))
+			return HCubeInvalidPosition;
+
+		const size_t bins = grid.getBins();
+		grid.create(bins, regionSize);
+
+		const double o[3] = {origin.x, origin.y, origin.z};
+		const double lower[3] = {0, 0, 0};
+		const double voxel = double(regionSize) / bins;
+
+		#pragma omp parallel for schedule(dynamic, 1)
+		for (size_t x = 0; x < bins; x++) {
+			const size_t lo[3] = {x, 0, 0};
+			const size_t hi[3] = {x + 1, bins, bins};
+			extract(grid, o, voxel, lower, size, lo, hi);
 		}
 
-		if (k >= N) {
-#ifdef DEBUG
-			std::cout << "invalid k: " << k << " z" << position.z << " size: "
-			          << size << std::endl;
-#endif
-			throw invalid_position();
+		return HCubeValid;
+	}
+
+	// Fills the voxels lo to hi, which lie inside this cube at lower.
+	void extract(Grid<T>& grid, const double* origin, double voxel,
+	             const double* lower, double size, const size_t* lo,
+	             const size_t* hi) const {
+		const double s = size / N;
+		size_t bounds[3][N + 1];
+
+		// first voxel of each element, the voxel centers on a face belong to
+		// the upper element as in lookup
+		for (size_t a = 0; a < 3; a++) {
+			bounds[a][0] = lo[a];
+			bounds[a][N] = hi[a];
+
+			for (size_t e = 1; e < N; e++) {
+				double v = std::ceil((lower[a] + e * s - origin[a]) / voxel - 0.5);
+				bounds[a][e] = std::min(std::max(v, (double) lo[a]), (double) hi[a]);
+			}
 		}
 
-		const Vector3f& v = at(i, j, k);
+		for (size_t i = 0; i < N; i++) {
+			if (bounds[0][i] >= bounds[0][i + 1])
+				continue;
 
-		if (isCube(v)) {
-			const HCube* c = toCube(v);
-			return c->getDepth(position - Vector3f(i * s, j * s, k * s), s,
-			                   depth + 1);
-		} else {
-			return depth;
+			for (size_t j = 0; j < N; j++) {
+				if (bounds[1][j] >= bounds[1][j + 1])
+					continue;
+
+				for (size_t k = 0; k < N; k++) {
+					if (bounds[2][k] >= bounds[2][k + 1])
+						continue;
+
+					const T& e = at(i, j, k);
+					const size_t clo[3] = {bounds[0][i], bounds[1][j], bounds[2][k]};
+					const size_t chi[3] = {bounds[0][i + 1], bounds[1][j + 1],
+					                       bounds[2][k + 1]};
+
+					if (isCube(e)) {
+						const double clower[3] = {lower[0] + i * s, lower[1] + j * s,
+						                          lower[2] + k * s};
+						toCube(e)->extract(grid, origin, voxel, clower, s, clo, chi);
+						continue;
+					}
+
+					for (size_t x = clo[0]; x < chi[0]; x++)
+						for (size_t y = clo[1]; y < chi[1]; y++) {
+							T* row = &grid.get(x, y, clo[2]);
+							std::fill(row, row + (chi[2] - clo[2]), e);
+						}
+				}
+			}
 		}
 	}
 
-	size_t getCubeCount() const {
-		size_t n = N * N * N;
-		size_t count = 1;
+	// Value at position, descending at most maxDepth levels below this cube.
+	// Deeper cells are represented by the mean of their subtree, means holds
+	// one value per cube in index order starting at this cube.
+	HCubeStatus getValue(const Vector3f& position, float size, size_t maxDepth,
+	                     const T* means, T& value) const {
+		const float scale = N / size;
+		float u = position.x * scale;
+		float v = position.y * scale;
+		float w = position.z * scale;
+
+		if (!(u >= 0 && u < N && v >= 0 && v < N && w >= 0 && w < N)) {
+			value = T();
+			return HCubeInvalidPosition;
+		}
 
-		for (size_t i = 0; i < n; i++) {
-			if (isCube(elements[i])) {
-				const HCube* c = toCube(elements[i]);
-				count += c->getCubeCount();
+		const HCube<N, T>* cube = this;
+
+		for (size_t depth = 0;; depth++) {
+			int i = std::min((int) u, (int) N - 1);
+			int j = std::min((int) v, (int) N - 1);
+			int k = std::min((int) w, (int) N - 1);
+			const T& e = cube->at(i, j, k);
+
+			if (!isCube(e)) {
+				value = e;
+				return HCubeValid;
 			}
+
+			cube = cube->toCube(e);
+
+			if (depth == maxDepth) {
+				value = means[cube - this];
+				return HCubeValid;
+			}
+
+			u = (u - i) * N;
+			v = (v - j) * N;
+			w = (w - k) * N;
 		}
+	}
 
-		return count;
+	// Mean of each of the count cubes at src, in reverse index order so the
+	// means of the children are known before their parents.
+	static void computeMeans(const HCube<N, T>* src, size_t count, T* means) {
+		const size_t N3 = N * N * N;
+		const size_t C = traits_t::channels;
+
+		for (size_t c = count; c-- > 0;) {
+			double sum[C];
+
+			for (size_t l = 0; l < C; l++)
+				sum[l] = 0;
+
+			for (size_t n = 0; n < N3; n++) {
+				const T& e = src[c].elements[n];
+				const float* m = (const float*) (isCube(e) ? &means[c + toOffset(e)] : &e);
+
+				for (size_t l = 0; l < C; l++)
+					sum[l] += m[l];
+			}
+
+			float* mean = (float*) &means[c];
+
+			for (size_t l = 0; l < C; l++)
+				mean[l] = sum[l] / N3;
+		}
 	}
 
-	class SamplingVisitor: public DatabaseVisitor {
-		HCube<N>& cube;
-		Vector3f offset;
-		float size, cell;
-		AABB<float> box;
+	// Deepest level whose cells can be indexed with 63 bit integers.
+	static size_t maxInterpolationDepth() {
+		size_t depth = 0;
+		for (uint64_t r = N; r <= (uint64_t(1) << 62) / N; r *= N)
+			depth++;
+		return std::min(depth, (size_t) 64);
+	}
 
-		size_t toLowerIndex(double x) {
-			return (size_t) clamp((int) ::floor(x / cell), (int) 0,
-			                      (int) cube.getN() - 1);
+	// Value of the cell with the integer coordinates c at the resolution of the
+	// leaf cube path[depth]. The search starts at the deepest ancestor on the
+	// path that contains the cell. Below the resolution the cell center is
+	// followed.
+	static const Vector3f& cellValue(const HCube<N, T>* const* path, size_t depth,
+	                                 const uint64_t* cell, const uint64_t* c) {
+		size_t l = depth;
+		uint64_t div = N;
+
+		while (l > 0 && (c[0] / div != cell[0] / div || c[1] / div != cell[1] / div
+		                 || c[2] / div != cell[2] / div)) {
+			l--;
+			div *= N;
 		}
 
-		size_t toUpperIndex(double x) {
-			return (size_t) clamp((int) ::ceil(x / cell), (int) 0,
-			                      (int) cube.getN() - 1);
+		const HCube<N, T>* cube = path[l];
+
+		while (true) {
+			size_t i = N / 2, j = N / 2, k = N / 2;
+
+			if (div > 1) {
+				div /= N;
+				i = (c[0] / div) % N;
+				j = (c[1] / div) % N;
+				k = (c[2] / div) % N;
+			}
+
+			const T& e = cube->at(i, j, k);
+
+			if (!isCube(e))
+				return e;
+
+			cube = cube->toCube(e);
 		}
+	}
 
-		template<class T>
-		static T clamp(const T& value, const T& min, const T& max) {
-			if (value < min)
-				return min;
-			else if (value > max)
-				return max;
-			else
-				return value;
+	// Trilinear interpolation between the centers of the eight cells around
+	// position, at the resolution of the leaf containing it. Coarser
+	// neighbours contribute their constant value, finer ones the value at
+	// their center. Cells outside the cube are clamped to the border.
+	HCubeStatus interpolate(const Vector3f& position, float size,
+	                        Vector3f& value) const {
+		const double scale = N / size;
+		double u = position.x * scale;
+		double v = position.y * scale;
+		double w = position.z * scale;
+		value = Vector3f(0, 0, 0);
+
+		if (!(u >= 0 && u < N && v >= 0 && v < N && w >= 0 && w < N))
+			return HCubeInvalidPosition;
+
+		const HCube<N, T>* path[64];
+		uint64_t cell[3] = { 0, 0, 0 };
+		const size_t max_depth = maxInterpolationDepth();
+		const HCube<N, T>* cube = this;
+		size_t depth = 0;
+
+		while (true) {
+			int i = std::min((int) u, (int) N - 1);
+			int j = std::min((int) v, (int) N - 1);
+			int k = std::min((int) w, (int) N - 1);
+			const T& e = cube->at(i, j, k);
+			path[depth] = cube;
+			cell[0] = cell[0] * N + i;
+			cell[1] = cell[1] * N + j;
+			cell[2] = cell[2] * N + k;
+
+			if (!isCube(e))
+				break;
+
+			// too deep to index the cells
+			if (depth + 1 >= max_depth) {
+				value = getValue(position, size);
+				return HCubeValid;
+			}
+
+			cube = cube->toCube(e);
+			u = (u - i) * N;
+			v = (v - j) * N;
+			w = (w - k) * N;
+			depth++;
 		}
 
-	public:
+		const double cells = pow((double) N, (double) (depth + 1));
+		const double g[3] = { position.x / size * cells - 0.5,
+		                      position.y / size * cells - 0.5,
+		                      position.z / size * cells - 0.5 };
+		int64_t lower[3];
+		double f[3];
 
-		SamplingVisitor(HCube<N>& cube, const Vector3f& offset, float size) :
-			cube(cube), offset(offset), size(size) {
-			cell = size / cube.getN();
-			box.min = offset;
-			box.max = offset + Vector3f(size);
+		for (size_t a = 0; a < 3; a++) {
+			lower[a] = (int64_t) floor(g[a]);
+			f[a] = g[a] - lower[a];
 		}
 
-		void begin(const Database& db) {
-			for (size_t i = 0; i < N; i++) {
-				for (size_t j = 0; j < N; j++) {
-					for (size_t k = 0; k < N; k++) {
-						cube.at(i, j, k) = Vector3f(0, 0, 0);
-					}
-				}
+		double b[3] = { 0, 0, 0 };
+
+		for (size_t corner = 0; corner < 8; corner++) {
+			double weight = 1;
+			uint64_t c[3];
+
+			for (size_t a = 0; a < 3; a++) {
+				const int64_t upper = (corner >> (2 - a)) & 1;
+				weight *= upper ? f[a] : 1 - f[a];
+				const int64_t x = lower[a] + upper;
+				c[a] = (uint64_t) std::min(std::max(x, (int64_t) 0),
+				                           (int64_t) cells - 1);
 			}
+
+			if (weight == 0)
+				continue;
+
+			const Vector3f& e = cellValue(path, depth, cell, c);
+			b[0] += e.x * weight;
+			b[1] += e.y * weight;
+			b[2] += e.z * weight;
 		}
 
-		bool intersects(const Vector3f& lower, const Vector3f& upper, float margin) {
-			AABB<float> other(lower - Vector3f(margin), upper + Vector3f(margin));
-			return box.intersects(other);
+		value = Vector3f(b[0], b[1], b[2]);
+		return HCubeValid;
+	}
+
+	// Jacobian at the leaf cell containing position, from central differences
+	// of its neighbours at the leaf resolution, one sided at the border of the
+	// cube. The tree is descended once, the neighbours are searched from
+	// their deepest common ancestor on the path, see cellValue.
+	HCubeStatus jacobian(const Vector3f& position, float size,
+	                     HCubeJacobian& jacobian) const {
+		const double scale = N / size;
+		double u = position.x * scale;
+		double v = position.y * scale;
+		double w = position.z * scale;
+		jacobian = HCubeJacobian();
+
+		if (!(u >= 0 && u < N && v >= 0 && v < N && w >= 0 && w < N))
+			return HCubeInvalidPosition;
+
+		const HCube<N, T>* path[64];
+		uint64_t cell[3] = { 0, 0, 0 };
+		uint64_t cells = N;
+		const size_t max_depth = maxInterpolationDepth();
+		const HCube<N, T>* cube = this;
+		size_t depth = 0;
+
+		while (true) {
+			int i = std::min((int) u, (int) N - 1);
+			int j = std::min((int) v, (int) N - 1);
+			int k = std::min((int) w, (int) N - 1);
+			const T& e = cube->at(i, j, k);
+			path[depth] = cube;
+			cell[0] = cell[0] * N + i;
+			cell[1] = cell[1] * N + j;
+			cell[2] = cell[2] * N + k;
+
+			// below the indexable depth the cells are followed at their center
+			if (!isCube(e) || depth + 1 >= max_depth)
+				break;
+
+			cube = cube->toCube(e);
+			u = (u - i) * N;
+			v = (v - j) * N;
+			w = (w - k) * N;
+			cells *= N;
+			depth++;
 		}
 
-		void visit(const SmoothParticle& part) {
-			SmoothParticle particle = part;
-//			particle.smoothingLength += _broadeningFactor
-//					* _grid.getCellLength();
+		const double h = size / (double) cells;
+		Vector3f* d[3] = { &jacobian.dx, &jacobian.dy, &jacobian.dz };
+		jacobian.value = cellValue(path, depth, cell, cell);
 
-			Vector3f value = particle.bfield * particle.weight() * particle.mass
-			                 / particle.rho;
-			float r = particle.smoothingLength + cell;
+		for (size_t a = 0; a < 3; a++) {
+			uint64_t lower[3] = { cell[0], cell[1], cell[2] };
+			uint64_t upper[3] = { cell[0], cell[1], cell[2] };
 
-			Vector3f relativePosition = particle.position - offset;
-			size_t x_min = toLowerIndex(relativePosition.x - r);
-			size_t x_max = toUpperIndex(relativePosition.x + r);
+			if (lower[a] > 0)
+				lower[a]--;
+			if (upper[a] + 1 < cells)
+				upper[a]++;
 
-			size_t y_min = toLowerIndex(relativePosition.y - r);
-			size_t y_max = toUpperIndex(relativePosition.y + r);
+			const Vector3f& l = cellValue(path, depth, cell, lower);
+			const Vector3f& r = cellValue(path, depth, cell, upper);
+			*d[a] = (r - l) / float((upper[a] - lower[a]) * h);
+		}
 
-			size_t z_min = toLowerIndex(relativePosition.z - r);
-			size_t z_max = toUpperIndex(relativePosition.z + r);
+		return HCubeValid;
+	}
 
-			Vector3f p;
-			#pragma omp parallel for
+	// Jacobians at n positions in parallel. Returns false if a position was
+	// outside the cube.
+	bool jacobians(const Vector3f* positions, size_t n, float size,
+	               HCubeJacobian* out) const {
+		bool valid = true;
 
-			for (size_t x = x_min; x <= x_max; x++) {
-				p.x = x * cell;
+		#pragma omp parallel for schedule(dynamic, 256) reduction(&&:valid)
+		for (long i = 0; i < (long) n; i++)
+			valid = (jacobian(positions[i], size, out[i]) == HCubeValid) && valid;
 
-				for (size_t y = y_min; y <= y_max; y++) {
-					p.y = y * cell;
+		return valid;
+	}
 
-					for (size_t z = z_min; z <= z_max; z++) {
-						p.z = z * cell;
-						float k = particle.kernel(offset + p);
-						cube.at(x, y, z) += value * k;
-					}
+	// Batched lookup of n positions relative to the cube. All positions are
+	// descended together, one level at a time. Per level the index
+	// computation and the gather of the first float of each element, which
+	// tells leaves from child cubes, run over contiguous lane arrays. Only the
+	// compaction of the lanes that descend further is scalar. Positions
+	// outside the cube get a zero value. Returns false if at least one
+	// position was outside.
+	bool getValues(const float* x, const float* y, const float* z,
+	               T* out, size_t n, float size) const {
+		const size_t chunk = 256;
+		const size_t N2 = N * N;
+		const float scale = N / size;
+
+		// elements are records of floats, addressed in floats from this
+		const float* base = (const float*) this;
+		const size_t cubeFloats = sizeof(HCube<N, T>) / sizeof(float);
+		const size_t elementFloats = sizeof(T) / sizeof(float);
+
+		size_t cubes[chunk], elems[chunk], lanes[chunk];
+		float u[chunk], v[chunk], w[chunk], heads[chunk];
+		bool valid = true;
+
+		for (size_t first = 0; first < n; first += chunk) {
+			const size_t count = std::min(chunk, n - first);
+			size_t active = 0;
+
+			// scale to root cell units, reject positions outside the cube
+			for (size_t l = 0; l < count; l++) {
+				const float a = x[first + l] * scale;
+				const float b = y[first + l] * scale;
+				const float c = z[first + l] * scale;
+
+				if (a >= 0 && a < N && b >= 0 && b < N && c >= 0 && c < N) {
+					cubes[active] = 0;
+					u[active] = a;
+					v[active] = b;
+					w[active] = c;
+					lanes[active] = first + l;
+					active++;
+				} else {
+					out[first + l] = T();
+					valid = false;
 				}
 			}
 
+			while (active) {
+				// child elements, and positions in child cell units
+				#pragma omp simd
+				for (size_t a = 0; a < active; a++) {
+					int i = std::min((int) u[a], (int) N - 1);
+					int j = std::min((int) v[a], (int) N - 1);
+					int k = std::min((int) w[a], (int) N - 1);
+					elems[a] = cubes[a] * cubeFloats
+					           + (i * N2 + j * N + k) * elementFloats;
+					heads[a] = base[elems[a]];
+					u[a] = (u[a] - i) * N;
+					v[a] = (v[a] - j) * N;
+					w[a] = (w[a] - k) * N;
+				}
+
+				// write the leaves, keep lanes that descend into a child cube
+				size_t next = 0;
+
+				for (size_t a = 0; a < active; a++) {
+					const T& e = *(const T*) (base + elems[a]);
+
+					// child references have a NaN in the first float
+					if (heads[a] == heads[a]) {
+						out[lanes[a]] = e;
+					} else {
+						cubes[next] = cubes[a] + toOffset(e);
+						u[next] = u[a];
+						v[next] = v[a];
+						w[next] = w[a];
+						lanes[next] = lanes[a];
+						next++;
+					}
+				}
+
+				active = next;
+			}
 		}
 
-		void end() {
+		return valid;
+	}
+
+	size_t getDepth(const Vector3f& position, float size,
+	                size_t depth = 0) const {
+		const T* v;
+		size_t d;
 
+		if (lookup(position, size, v, d) != HCubeValid)
+			throw invalid_position();
+
+		return depth + d;
+	}
+
+	// Cubes of the tree, shared subtrees are counted once per reference.
+	size_t getCubeCount() const {
+		size_t n = N * N * N;
+		size_t count = 1;
+
+		for (size_t i = 0; i < n; i++) {
+			if (isCube(elements[i])) {
+				const HCube* c = toCube(elements[i]);
+				count += c->getCubeCount();
+			}
 		}
-	};
+
+		return count;
+	}
 
 	static size_t memoryUsage(size_t depth) {
 		size_t n = N * N * N;
 		size_t size = 0;
 
 		for (size_t i = 0; i <= depth; i++)
-			size += ::pow(n, i) * n * sizeof(Vector3f);
+			size += ::pow(n, i) * n * sizeof(T);
 
 		return size;
 	}
+
+	// maximum number of cubes in a subtree with the given depth
+	static size_t regionSize(size_t depth) {
+		return memoryUsage(depth) / sizeof(HCube<N, T>);
+	}
 };
 
 typedef HCube<2> HCube2;
@@ -825,37 +2212,234 @@ typedef HCube<16> HCube16;
 typedef HCube<32> HCube32;
 typedef HCube<64> HCube64;
 
-template<int N>
+template<int N, typename T = Vector3f>
 class HCubeFile: public MMapFile {
 
-	typedef HCube<N> hcube_t;
+	typedef HCube<N, T> hcube_t;
+
+	size_t _offset;
+	HCubeHeader _header;
+
+	void readHeader() {
+		_offset = 0;
+		_header = HCubeHeader();
+
+		if (size() < (off_t) sizeof(HCubeHeader))
+			return;
+
+		read(_header, 0);
+		if (!_header.valid()) {
+			_header = HCubeHeader();
+			return;
+		}
+
+		if (_header.version > HCubeHeader::version_current)
+			throw std::runtime_error("[HCubeFile] unsupported file version!");
+		if (_header.n != N)
+			throw std::runtime_error("[HCubeFile] file has different N!");
+		if (_header.encoding != HCubeElement<T>::encoding)
+			throw std::runtime_error("[HCubeFile] file has different encoding!");
+
+		_offset = HCubeHeader::dataOffset;
+	}
 
 public:
 
-	HCubeFile() {
+	HCubeFile() : _offset(0) {
 
 	}
 
 	HCubeFile(const std::string& filename, MappingType mtype = Auto) : MMapFile(filename, mtype) {
+		readHeader();
+	}
+
+	void open(const std::string& filename, MappingType mtype = Auto) {
+		MMapFile::open(filename, mtype);
+		readHeader();
+	}
+
+	const hcube_t* hcube() {
+		return data< hcube_t>(_offset);
+	}
+
+	// true if the file starts with a header
+	bool hasHeader() const {
+		return _offset != 0;
+	}
+
+	const HCubeHeader& header() const {
+		return _header;
+	}
+
+	// Subtree means, NULL if the file has none.
+	const T* means() {
+		if (!hasHeader() || !_header.means)
+			return 0;
+		return data<T>(_header.means);
+	}
+
+	// Appends the subtree means to an HCube file with header.
+	static bool appendMeans(const std::string& filename) {
+		HCubeHeader header;
+
+		if (!HCubeHeader::read(filename, header))
+			throw std::runtime_error("[HCubeFile] means need a file header!");
+		if (header.n != N || header.encoding != HCubeElement<T>::encoding)
+			throw std::runtime_error("[HCubeFile] file has different N or encoding!");
+
+		const size_t count = header.cubes;
+		header.means = mappingSize(count * sizeof(hcube_t));
+		MMapFileWrite mapping(filename, header.means + count * sizeof(T),
+		                      true);
+		hcube_t::computeMeans(cubes(mapping), count,
+		                      (T*) ((char*) mapping.data() + header.means));
+		header.updateChecksum();
+		memcpy(mapping.data(), &header, sizeof(HCubeHeader));
+
+		return true;
+	}
+
+	size_t getCubeCount() const {
+		if (hasHeader())
+			return _header.cubes;
+		else
+			return size() / sizeof(hcube_t);
+	}
+
+	// First cube of a write mapping of mappingSize() bytes.
+	static hcube_t* cubes(MMapFileWrite& mapping) {
+		return (hcube_t*) ((char*) mapping.data() + HCubeHeader::dataOffset);
+	}
+
+	static size_t mappingSize(size_t cubes_size) {
+		return HCubeHeader::dataOffset + cubes_size;
+	}
 
+	// Child offsets are below the number of cubes. Throws before anything is
+	// written if they may not fit into a child reference of T.
+	static void checkOffsets(size_t cubes) {
+		if (cubes > HCubeElement<T>::maxOffset)
+			throw std::runtime_error("[HCubeFile] too many cubes for the child references of the element type!");
 	}
 
-	const HCube<N>* hcube() {
-		return data< hcube_t>();
+	// Removes the output and checkpoint of a build whose offsets did not fit,
+	// resuming would fail again.
+	static void discard(const std::string& filename) {
+		std::remove(filename.c_str());
+		std::remove((filename + ".checkpoint").c_str());
 	}
 
+	// Writes the header and truncates the file to the used cubes.
+	static void finish(MMapFileWrite& mapping, const HCubeInitFlags& flags) {
+		const hcube_t* hcube = cubes(mapping);
+		size_t count = hcube->getCubeCount();
+		new (mapping.data()) HCubeHeader(N, flags, count, HCubeElement<T>::encoding);
+		mapping.unmap();
+		mapping.truncate(mappingSize(count * sizeof(hcube_t)));
+	}
+
+	// Writes the cubes of input in HCubeMortonLevels layout to output.
+	static bool repack(const std::string& input, const std::string& output) {
+		HCubeFile<N, T> src(input, OnDemand);
+
+		if (!src.hasHeader())
+			throw std::runtime_error("[HCubeFile] repack needs a file header!");
+
+		const size_t count = src.getCubeCount();
+		checkOffsets(count);
+		MMapFileWrite mapping(output, mappingSize(count * sizeof(hcube_t)));
+		size_t placed = hcube_t::repack(src.hcube(), count, cubes(mapping));
+
+		HCubeHeader* header = new (mapping.data()) HCubeHeader(src.header());
+		header->means = 0;
+		header->layout = HCubeMortonLevels;
+		header->cubes = placed;
+		header->updateChecksum();
+
+		mapping.unmap();
+		mapping.truncate(mappingSize(placed * sizeof(hcube_t)));
+
+		return true;
+	}
+
+	// Writes input to output with subcubes collapsed again with a new error
+	// and threshold. Shared subtrees are expanded.
+	static bool recompress(const std::string& input, const std::string& output,
+	                       float error, float threshold) {
+		HCubeFile<N, T> src(input, OnDemand);
+
+		if (!src.hasHeader())
+			throw std::runtime_error("[HCubeFile] recompress needs a file header!");
+
+		HCubeInitFlags flags;
+		flags.offsetKpc = src.header().origin;
+		flags.sizeKpc = src.header().size;
+		flags.maxdepth = src.header().depth;
+		flags.target_depth = src.header().depth;
+		flags.error = error;
+		flags.threshold = threshold;
+
+		size_t count = src.getCubeCount();
+		if (src.header().flags & HCubeShared)
+			count = src.hcube()->getCubeCount();
+
+		checkOffsets(count);
+		MMapFileWrite mapping(output, mappingSize(count * sizeof(hcube_t)));
+		hcube_t* hcube = new(cubes(mapping)) hcube_t;
+		size_t idx = 0;
+		hcube->recompress(src.hcube(), idx, flags);
+		finish(mapping, flags);
+
+		return true;
+	}
+
+	// Writes input to output with equal subtrees stored only once.
+	static bool deduplicate(const std::string& input, const std::string& output) {
+		HCubeFile<N, T> src(input, OnDemand);
+
+		if (!src.hasHeader())
+			throw std::runtime_error("[HCubeFile] deduplicate needs a file header!");
+
+		const size_t count = src.getCubeCount();
+		checkOffsets(count);
+		MMapFileWrite mapping(output, mappingSize(count * sizeof(hcube_t)));
+		size_t unique = hcube_t::deduplicate(src.hcube(), count, cubes(mapping));
+
+		HCubeHeader* header = new (mapping.data()) HCubeHeader(src.header());
+		header->means = 0;
+		header->layout = HCubeDepthFirst;
+		header->flags |= HCubeShared;
+		header->cubes = unique;
+		header->updateChecksum();
+
+		mapping.unmap();
+		mapping.truncate(mappingSize(unique * sizeof(hcube_t)));
+
+		return true;
+	}
+
+	// The sparse mapping of the cubes is limited to max_mapping bytes.
+	// Parallel builds need the complete tree, a larger one is built serially.
 	static bool create(Database* db, const Vector3f& offsetKpc, float sizeKpc,
 	                   float error, float threshold, size_t maxdepth, size_t target_depth,
-	                   const std::string& filename) {
-
-		size_t max_size = std::min((size_t)1 << 40UL, hcube_t::memoryUsage(maxdepth));
+	                   const std::string& filename, size_t parallel_levels = 1,
+	                   bool verbose = true, size_t max_mapping = (size_t) 1 << 40) {
+		size_t max_size = std::min(max_mapping, hcube_t::memoryUsage(maxdepth));
+
+		if (parallel_levels && max_size < hcube_t::memoryUsage(maxdepth)) {
+			std::cerr << "[HCubeFile] parallel build needs a mapping of "
+			          << hcube_t::memoryUsage(maxdepth) << " bytes, above the limit of "
+			          << max_mapping << ", building serially." << std::endl;
+			parallel_levels = 0;
+		}
 
 		std::string checkpoint_filename = filename + ".checkpoint";
 		HCubeInitCheckpoint checkpoint(checkpoint_filename);
 		bool resume = !checkpoint.empty();
 
-		MMapFileWrite mapping(filename, max_size, resume);
-		hcube_t* hcube = new(mapping.data()) hcube_t;
+		MMapFileWrite mapping(filename, mappingSize(max_size), resume);
+		hcube_t* hcube = new(cubes(mapping)) hcube_t;
+		checkpoint.syncBefore(mapping.data(), mapping.size());
 
 		size_t idx = 0;
 		HCubeInitFlags flags;
@@ -866,49 +2450,180 @@ public:
 		flags.target_depth = target_depth;
 		flags.threshold = threshold;
 		flags.sizeKpc = sizeKpc;
+		flags.parallel_levels = parallel_levels;
+		flags.verbose = verbose;
+
+		if (parallel_levels) {
+			bool failed = false;
+
+			#pragma omp parallel
+			#pragma omp single
+			{
+				try {
+					hcube->initParallel(db, offsetKpc, sizeKpc, 0, idx, flags,
+					                    checkpoint, parallel_levels);
+				} catch (HCubeOffsetError&) {
+					failed = true;
+				}
+			}
 
-		hcube->init(db, offsetKpc, sizeKpc, 0, idx, flags, checkpoint);
-
+			if (failed) {
+				discard(filename);
+				throw HCubeOffsetError();
+			}
 
-		off_t rsize = hcube->getCubeCount() * sizeof(hcube_t);
+			checkpoint.drop();
+		} else {
+			try {
+				hcube->init(db, offsetKpc, sizeKpc, 0, idx, flags, checkpoint);
+			} catch (HCubeOffsetError&) {
+				discard(filename);
+				throw;
+			}
+		}
 
-		mapping.unmap();
-		mapping.truncate(rsize);
+		checkpoint.flush();
+		checkpoint.syncBefore(0, 0);
+		finish(mapping, flags);
 
 		std::remove(checkpoint_filename.c_str());
 
 		return true;
 	}
 
-	static bool create(std::vector<std::string> &files, size_t levels,
-	                   float error, float threshold, size_t maxdepth, size_t target_depth,
-	                   const std::string& filename) {
+	// Variant of create(Database*, ...) without a sparse mapping of the
+	// maximum file size. Finished subcubes are written through a write back
+	// buffer of buffer_size bytes, memory and dirty pages stay bounded.
+	// Besides the buffer, the peak memory is one sampled subtree: its n^3
+	// elements plus the cubes of its full tree, about as many elements again.
+	// n is presampling rounded down to a power of N, 256 for N = 4, so about
+	// 400 MB for Vector3f elements.
+	static bool createStreaming(Database* db, const Vector3f& offsetKpc,
+	                            float sizeKpc, float error, float threshold,
+	                            size_t maxdepth, size_t target_depth,
+	                            const std::string& filename,
+	                            size_t buffer_size = 64 << 20,
+	                            bool verbose = true) {
+		std::string checkpoint_filename = filename + ".checkpoint";
+		HCubeInitCheckpoint checkpoint(checkpoint_filename);
+		bool resume = !checkpoint.empty();
 
-		size_t max_size = std::min((size_t)1 << 40UL, hcube_t::memoryUsage(maxdepth));
+		BufferedFileWrite out(filename, buffer_size, resume);
+		checkpoint.syncBefore(out.descriptor());
 
-		MMapFileWrite mapping(filename, max_size, false);
-		hcube_t* hcube = new(mapping.data()) hcube_t;
+		HCubeInitFlags flags;
+		flags.error = error;
+		flags.maxdepth = maxdepth;
+		flags.offsetKpc = offsetKpc;
+		flags.sizeKpc = sizeKpc;
+		flags.target_depth = target_depth;
+		flags.threshold = threshold;
+		flags.parallel_levels = 0;
+		flags.verbose = verbose;
 
+		std::vector<hcube_t> root(1);
 		size_t idx = 0;
+		try {
+			hcube_t::stream(db, offsetKpc, sizeKpc, 0, idx, flags, checkpoint, out,
+			                root[0]);
+		} catch (HCubeOffsetError&) {
+			discard(filename);
+			throw;
+		}
+		checkpoint.flush();
+		checkpoint.syncBefore(-1);
+
+		HCubeHeader header(N, flags, idx, HCubeElement<T>::encoding);
+		out.write(0, &header, sizeof(HCubeHeader));
+		out.truncate(mappingSize(idx * sizeof(hcube_t)));
+		out.close();
+
+		std::remove(checkpoint_filename.c_str());
+
+		return true;
+	}
+
+	// Merges the pieces of a split build. The layout is planned serially from
+	// the piece roots, then the pieces are verified and copied in parallel as
+	// single blocks. Child offsets are relative and need no relocation.
+	static bool create(std::vector<std::string> &files, size_t levels,
+	                   float error, float threshold, size_t maxdepth, size_t target_depth,
+	                   const std::string& filename) {
 		HCubeInitFlags flags;
 		flags.error = error;
 		flags.maxdepth = maxdepth;
 		flags.target_depth = target_depth;
 		flags.threshold = threshold;
+		flags.sizeKpc = 0;
+
+		if (files.size() != pow(N * N * N, levels + 1))
+			throw std::runtime_error("[HCubeFile] invalid number of merge pieces!");
+
+		std::vector< ref_ptr< HCubeFile<N, T> > > srcs_file(files.size());
+		std::vector< const hcube_t * > srcs(files.size());
+		std::vector<size_t> counts(files.size());
 
-		std::vector< HCubeFile<N> > srcs_file(files.size());
-		std::vector< const HCube<N> * > srcs(files.size());
 		for (size_t i = 0; i < files.size(); i++) {
-			srcs_file[i].open(files[i]);
-			srcs[i] = srcs_file[i].hcube();
+			srcs_file[i] = new HCubeFile<N, T>(files[i], OnDemand);
+			srcs[i] = srcs_file[i]->hcube();
+			counts[i] = srcs_file[i]->getCubeCount();
+
+			// pieces are copied as contiguous trees
+			if (srcs_file[i]->header().flags & HCubeShared)
+				throw std::runtime_error("[HCubeFile] cannot merge shared file: " + files[i]);
+
+			if (counts[i] == 0 || srcs_file[i]->_offset + counts[i] * sizeof(hcube_t)
+			        > (size_t) srcs_file[i]->size())
+				throw std::runtime_error("[HCubeFile] truncated merge piece: " + files[i]);
 		}
-		
-		hcube->init(srcs, idx, flags, levels);
 
-		off_t rsize = hcube->getCubeCount() * sizeof(hcube_t);
+		// the first piece starts at the origin of the merged cube
+		if (srcs_file.size() && srcs_file[0]->hasHeader()) {
+			const HCubeHeader& header = srcs_file[0]->header();
+			flags.offsetKpc = header.origin;
+			flags.sizeKpc = header.size * pow(N, levels + 1);
+		}
 
-		mapping.unmap();
-		mapping.truncate(rsize);
+		const size_t invalid = std::numeric_limits<size_t>::max();
+		std::vector<size_t> placement(files.size(), invalid);
+		std::vector<size_t> upperIdx;
+		std::vector<hcube_t> upper, root(1);
+		size_t idx = 0;
+		hcube_t::planMerge(srcs, counts, 0, levels, idx, flags, root[0],
+		                   placement, upperIdx, upper, invalid);
+
+		{
+			BufferedFileWrite out(filename);
+
+			for (size_t i = 0; i < upper.size(); i++)
+				out.write(hcube_t::fileOffset(upperIdx[i]), &upper[i], sizeof(hcube_t));
+
+			out.truncate(mappingSize(idx * sizeof(hcube_t)));
+		}
+
+		std::vector<char> valid(files.size(), 1);
+
+		#pragma omp parallel for schedule(dynamic, 1)
+		for (size_t i = 0; i < files.size(); i++) {
+			if (placement[i] == invalid)
+				continue;
+
+			valid[i] = hcube_t::verify(srcs[i], counts[i])
+			           && copyFileRange(files[i], srcs_file[i]->_offset, filename,
+			                            hcube_t::fileOffset(placement[i]),
+			                            counts[i] * sizeof(hcube_t));
+		}
+
+		for (size_t i = 0; i < files.size(); i++) {
+			if (!valid[i])
+				throw std::runtime_error("[HCubeFile] invalid merge piece: " + files[i]);
+		}
+
+		// the header last, an interrupted merge leaves no valid file
+		BufferedFileWrite out(filename, sizeof(HCubeHeader), true);
+		HCubeHeader header(N, flags, idx, HCubeElement<T>::encoding);
+		out.write(0, &header, sizeof(HCubeHeader));
+		out.close();
 
 		return true;
 	}
@@ -916,10 +2631,9 @@ public:
 	static bool create(MagneticField* field, const Vector3f& offsetKpc, float sizeKpc,
 	                   float error, float threshold, size_t maxdepth,
 	                   const std::string& filename) {
+		MMapFileWrite mapping(filename, mappingSize(hcube_t::memoryUsage(maxdepth)));
 
-		MMapFileWrite mapping(filename, hcube_t::memoryUsage(maxdepth));
-
-		hcube_t* hcube = new(mapping.data()) hcube_t;
+		hcube_t* hcube = new(cubes(mapping)) hcube_t;
 		size_t idx = 0;
 		HCubeInitFlags flags;
 		flags.error = error;
@@ -929,23 +2643,24 @@ public:
 		flags.target_depth = maxdepth;
 		flags.threshold = threshold;
 		flags.sizeKpc = sizeKpc;
-		hcube->init(field, offsetKpc, sizeKpc, 0, idx, flags);
+		try {
+			hcube->init(field, offsetKpc, sizeKpc, 0, idx, flags);
+		} catch (HCubeOffsetError&) {
+			discard(filename);
+			throw;
+		}
 
-		off_t rsize = hcube->getCubeCount() * sizeof(hcube_t);
-
-		mapping.unmap();
-		mapping.truncate(rsize);
+		finish(mapping, flags);
 
 		return true;
 	}
 
-	static bool create(Vector3f* data, size_t dataN, const Vector3f& offsetKpc,
+	static bool create(T* data, size_t dataN, const Vector3f& offsetKpc,
 	                   float sizeKpc, float error, float threshold, size_t maxdepth,
 	                   const std::string& filename) {
+		MMapFileWrite mapping(filename, mappingSize(hcube_t::memoryUsage(maxdepth)));
 
-		MMapFileWrite mapping(filename, hcube_t::memoryUsage(maxdepth));
-
-		hcube_t* hcube = new(mapping.data()) hcube_t;
+		hcube_t* hcube = new(cubes(mapping)) hcube_t;
 		size_t idx = 0;
 		HCubeInitFlags flags;
 		flags.error = error;
@@ -956,17 +2671,19 @@ public:
 		flags.threshold = threshold;
 		flags.sizeKpc = sizeKpc;
 
-		hcube->init(data, dataN, sizeKpc, offsetKpc, sizeKpc, 0, idx, flags);
-
-		off_t rsize = hcube->getCubeCount() * sizeof(hcube_t);
+		try {
+			hcube->init(data, dataN, sizeKpc, offsetKpc, sizeKpc, 0, idx, flags);
+		} catch (HCubeOffsetError&) {
+			discard(filename);
+			throw;
+		}
 
-		mapping.unmap();
-		mapping.truncate(rsize);
+		finish(mapping, flags);
 
 		return true;
 	}
 
-	static bool create(Grid<Vector3f>& grid, const Vector3f& offsetKpc,
+	static bool create(Grid<T>& grid, const Vector3f& offsetKpc,
 	                   float sizeKpc, float error, float threshold, size_t maxdepth,
 	                   const std::string& filename) {
 
@@ -974,32 +2691,63 @@ public:
 		              error, threshold, maxdepth, filename);
 	}
 
-	static bool createFromRaw(const std::string rawfilename, size_t dataN,
-	                          const Vector3f& offsetKpc, float sizeKpc, float error,
-	                          float threshold, size_t maxdepth, const std::string& filename) {
-		std::ifstream in(rawfilename.c_str(), std::ios::binary);
-		MMapFileWrite mapping(filename, hcube_t::memoryUsage(maxdepth));
-
-		hcube_t* hcube = new(mapping.data()) hcube_t;
-		size_t idx = 0;
+	// Bottom-up build from a field of N^(maxdepth + 1) elements per axis
+	// read in slabs, see HCube::build. Neither the field nor the cubes need to
+	// fit into memory.
+	static bool createFromSlabs(HCubeSlabReader<T>& in, const Vector3f& offsetKpc,
+	                            float sizeKpc, float error, float threshold,
+	                            size_t maxdepth, size_t target_depth,
+	                            const std::string& filename,
+	                            size_t buffer_size = 64 << 20,
+	                            bool verbose = true) {
+		BufferedFileWrite out(filename, buffer_size);
 
 		HCubeInitFlags flags;
 		flags.error = error;
 		flags.maxdepth = maxdepth;
 		flags.offsetKpc = offsetKpc;
 		flags.sizeKpc = sizeKpc;
-		flags.target_depth = maxdepth;
+		flags.target_depth = target_depth;
 		flags.threshold = threshold;
-		flags.sizeKpc = sizeKpc;
-		hcube->init(in, dataN, sizeKpc, offsetKpc, sizeKpc, 0, idx, flags);
+		flags.verbose = verbose;
 
-		off_t rsize = hcube->getCubeCount() * sizeof(hcube_t);
+		size_t count = 0;
 
-		mapping.unmap();
-		mapping.truncate(rsize);
+		try {
+			count = hcube_t::build(in, flags, out);
+		} catch (HCubeOffsetError&) {
+			discard(filename);
+			throw;
+		}
+		hcube_t::reverse(out, count,
+		                 std::max((size_t) 1, buffer_size / sizeof(hcube_t) / 2));
+
+		HCubeHeader header(N, flags, count, HCubeElement<T>::encoding);
+		header.layout = HCubeSlabsReversed;
+		header.updateChecksum();
+		out.write(0, &header, sizeof(HCubeHeader));
+		out.truncate(mappingSize(count * sizeof(hcube_t)));
+		out.close();
 
 		return true;
 	}
+
+	// The raw file holds dataN^3 elements of edge length sizeKpc / dataN. The
+	// field of N^(maxdepth + 1) elements is read from offsetKpc on.
+	static bool createFromRaw(const std::string rawfilename, size_t dataN,
+	                          const Vector3f& offsetKpc, float sizeKpc, float error,
+	                          float threshold, size_t maxdepth, const std::string& filename,
+	                          bool verbose = true) {
+		size_t n = N;
+		for (size_t d = 0; d < maxdepth; d++)
+			n *= N;
+
+		const float dataStep = sizeKpc / dataN;
+		HCubeRawSlabReader<T> in(rawfilename, dataN, n, offsetKpc.x / dataStep,
+		                         offsetKpc.y / dataStep, offsetKpc.z / dataStep);
+		return createFromSlabs(in, offsetKpc, sizeKpc, error, threshold, maxdepth,
+		                       maxdepth, filename, 64 << 20, verbose);
+	}
 };
 
 typedef HCubeFile<2> HCubeFile2;
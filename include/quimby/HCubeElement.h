@@ -0,0 +1,188 @@
+#pragma once
+
+#include "Vector3.h"
+#include "SmoothParticle.h"
+
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <stdint.h>
+
+namespace quimby {
+
+// Storage of the cube elements.
+typedef enum HCubeEncoding_ {
+	HCubeFloat,	// Vector3f elements, HCube<N>
+	HCubeHalfFloat,	// scaled fp16 elements, HCubeHalf<N>
+	HCubeScalarFloat,	// float elements, HCube<N, float>
+	HCubeBRhoFloat	// field and density, HCube<N, HCubeBRho>
+} HCubeEncoding;
+
+// Magnetic field and gas density in one element.
+struct HCubeBRho {
+	Vector3f b;
+	float rho;
+
+	HCubeBRho() :
+			rho(0) {
+	}
+
+	HCubeBRho(const Vector3f& b, float rho) :
+			b(b), rho(rho) {
+	}
+
+	HCubeBRho operator +(const HCubeBRho& v) const {
+		return HCubeBRho(b + v.b, rho + v.rho);
+	}
+
+	HCubeBRho operator -(const HCubeBRho& v) const {
+		return HCubeBRho(b - v.b, rho - v.rho);
+	}
+
+	HCubeBRho operator *(float f) const {
+		return HCubeBRho(b * f, rho * f);
+	}
+
+	HCubeBRho operator /(float f) const {
+		return HCubeBRho(b / f, rho / f);
+	}
+
+	HCubeBRho& operator +=(const HCubeBRho& v) {
+		b += v.b;
+		rho += v.rho;
+		return *this;
+	}
+
+	HCubeBRho& operator /=(float f) {
+		b /= f;
+		rho /= f;
+		return *this;
+	}
+};
+
+// Thrown when a child offset does not fit into the element type.
+struct HCubeOffsetError: public std::runtime_error {
+	HCubeOffsetError() :
+			std::runtime_error("[HCube] child offset exceeds the element type!") {
+	}
+};
+
+// Element types of HCube<N, T>. Elements are records of floats, a child
+// reference has a NaN in the first float and the forward offset to the child
+// in the following bits. The error and threshold of a collapse are tested
+// per part, length2(v, part) is the squared norm of a part.
+template<typename T>
+struct HCubeElement;
+
+template<>
+struct HCubeElement<Vector3f> {
+	enum {
+		encoding = HCubeFloat,
+		channels = 3,
+		parts = 1
+	};
+
+	static const uint64_t maxOffset = std::numeric_limits<uint64_t>::max();
+
+	static bool isCube(const Vector3f& v) {
+		return (v.x != v.x);
+	}
+
+	static uint64_t toOffset(const Vector3f& v) {
+		uint32_t* a = (uint32_t*) &v.y;
+		uint32_t* b = (uint32_t*) &v.z;
+		return (uint64_t) * a | (uint64_t)(*b) << 32;
+	}
+
+	static void setCube(Vector3f& v, uint64_t cube) {
+		v.x = std::numeric_limits<float>::quiet_NaN();
+		uint32_t* a = (uint32_t*) &v.y;
+		*a = (cube & 0xffffffff);
+		uint32_t* b = (uint32_t*) &v.z;
+		*b = (cube >> 32 & 0xffffffff);
+	}
+
+	static float length2(const Vector3f& v, size_t) {
+		return v.x * v.x + v.y * v.y + v.z * v.z;
+	}
+
+	static Vector3f sample(const SmoothParticle& p, const KernelPayload* k) {
+		return k ? k->bfield : sampleBField(p);
+	}
+};
+
+// Scalars keep the offset in the 22 bit payload of a quiet NaN and its sign
+// bit, offsets are limited to 2^23 cubes. The builds of HCubeFile check the
+// offsets they set and remove the output of a tree that does not fit.
+template<>
+struct HCubeElement<float> {
+	enum {
+		encoding = HCubeScalarFloat,
+		channels = 1,
+		parts = 1
+	};
+
+	static const uint64_t maxOffset = (1 << 23) - 1;
+
+	static bool isCube(const float& v) {
+		return (v != v);
+	}
+
+	static uint64_t toOffset(const float& v) {
+		uint32_t a;
+		memcpy(&a, &v, sizeof(float));
+		return (a & 0x3fffff) | (a >> 31) << 22;
+	}
+
+	static void setCube(float& v, uint64_t cube) {
+		if (cube > maxOffset)
+			throw HCubeOffsetError();
+
+		uint32_t a = 0x7fc00000 | uint32_t(cube & 0x3fffff)
+		             | uint32_t(cube >> 22) << 31;
+		memcpy(&v, &a, sizeof(float));
+	}
+
+	static float length2(const float& v, size_t) {
+		return v * v;
+	}
+
+	static float sample(const SmoothParticle& p, const KernelPayload* k) {
+		return k ? k->density : sampleDensity(p);
+	}
+};
+
+template<>
+struct HCubeElement<HCubeBRho> {
+	enum {
+		encoding = HCubeBRhoFloat,
+		channels = 4,
+		parts = 2	// field and density have unrelated units
+	};
+
+	static const uint64_t maxOffset = std::numeric_limits<uint64_t>::max();
+
+	static bool isCube(const HCubeBRho& v) {
+		return HCubeElement<Vector3f>::isCube(v.b);
+	}
+
+	static uint64_t toOffset(const HCubeBRho& v) {
+		return HCubeElement<Vector3f>::toOffset(v.b);
+	}
+
+	static void setCube(HCubeBRho& v, uint64_t cube) {
+		HCubeElement<Vector3f>::setCube(v.b, cube);
+		v.rho = 0;
+	}
+
+	static float length2(const HCubeBRho& v, size_t part) {
+		return part ? v.rho * v.rho : HCubeElement<Vector3f>::length2(v.b, 0);
+	}
+
+	static HCubeBRho sample(const SmoothParticle& p, const KernelPayload* k) {
+		return k ? HCubeBRho(k->bfield, k->density)
+		         : HCubeBRho(sampleBField(p), sampleDensity(p));
+	}
+};
+
+} // namespace quimby
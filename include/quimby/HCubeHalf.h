@@ -0,0 +1,351 @@
+#pragma once
+
+#include "HCube.h"
+
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <stdexcept>
+
+namespace quimby {
+
+// IEEE 754 half precision, round to nearest even.
+inline uint16_t floatToHalf(float f) {
+	uint32_t x;
+	memcpy(&x, &f, sizeof(float));
+	const uint32_t sign = (x >> 16) & 0x8000;
+	const uint32_t exponent = (x >> 23) & 0xff;
+	uint32_t mantissa = x & 0x007fffff;
+
+	// inf and nan
+	if (exponent == 0xff)
+		return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+
+	const int32_t e = int32_t(exponent) - 127 + 15;
+
+	if (e >= 31)
+		return sign | 0x7c00;
+
+	// subnormal or zero
+	if (e <= 0) {
+		if (e < -10)
+			return sign;
+
+		mantissa |= 0x00800000;
+		const uint32_t shift = 14 - e;
+		uint32_t h = mantissa >> shift;
+		const uint32_t rest = mantissa & ((1u << shift) - 1);
+		const uint32_t halfway = 1u << (shift - 1);
+
+		if (rest > halfway || (rest == halfway && (h & 1)))
+			h++;
+
+		return sign | h;
+	}
+
+	// a carry out of the mantissa correctly increments the exponent
+	uint32_t h = sign | (e << 10) | (mantissa >> 13);
+	const uint32_t rest = mantissa & 0x1fff;
+
+	if (rest > 0x1000 || (rest == 0x1000 && (h & 1)))
+		h++;
+
+	return h;
+}
+
+inline float halfToFloat(uint16_t h) {
+	const uint32_t sign = uint32_t(h & 0x8000) << 16;
+	uint32_t exponent = (h >> 10) & 0x1f;
+	uint32_t mantissa = h & 0x3ff;
+	uint32_t x;
+
+	if (exponent == 0) {
+		if (mantissa == 0) {
+			x = sign;
+		} else {
+			// normalize subnormal
+			exponent = 127 - 15 + 1;
+
+			while (!(mantissa & 0x400)) {
+				mantissa <<= 1;
+				exponent--;
+			}
+
+			x = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+		}
+	} else if (exponent == 31) {
+		x = sign | 0x7f800000 | (mantissa << 13);
+	} else {
+		x = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+	}
+
+	float f;
+	memcpy(&f, &x, sizeof(float));
+	return f;
+}
+
+// Compact HCube with fp16 elements scaled by the largest component of the
+// cube, 6 instead of 12 bytes per element. Child references are a NaN tag in
+// x and a 32 bit forward offset in y and z.
+template<size_t N>
+class HCubeHalf {
+	enum {
+		N3 = N * N * N,
+		cubeTag = 0x7e00
+	};
+
+	float scale;
+	uint16_t elements[N3][3];
+
+public:
+
+	const uint16_t* at(size_t i, size_t j, size_t k) const {
+		return elements[i * N * N + j * N + k];
+	}
+
+	static bool isCube(const uint16_t* e) {
+		return e[0] == cubeTag;
+	}
+
+	const HCubeHalf<N>* toCube(const uint16_t* e) const {
+		return this + (uint32_t(e[1]) | uint32_t(e[2]) << 16);
+	}
+
+	Vector3f decode(const uint16_t* e) const {
+		return Vector3f(halfToFloat(e[0]), halfToFloat(e[1]),
+		                halfToFloat(e[2])) * scale;
+	}
+
+	// Encodes a cube with the same child offsets, false if an offset does not
+	// fit into 32 bit. finite is cleared if an element is inf or nan, these
+	// would collide with the cube tag. exceeded counts the elements whose
+	// decoded value misses the relative error and the absolute threshold, as
+	// in HCube::collapse.
+	bool encode(const HCube<N>& cube, float error, float threshold,
+	            bool& finite, size_t& exceeded) {
+		scale = 0;
+
+		for (size_t i = 0; i < N; i++)
+			for (size_t j = 0; j < N; j++)
+				for (size_t k = 0; k < N; k++) {
+					const Vector3f& v = cube.at(i, j, k);
+
+					if (HCube<N>::isCube(v))
+						continue;
+
+					if (!std::isfinite(v.x) || !std::isfinite(v.y)
+					        || !std::isfinite(v.z))
+						finite = false;
+					else
+						scale = std::max(scale, std::max(std::fabs(v.x),
+						                 std::max(std::fabs(v.y), std::fabs(v.z))));
+				}
+
+		const float inverse = (scale > 0) ? 1 / scale : 0;
+
+		for (size_t i = 0; i < N; i++)
+			for (size_t j = 0; j < N; j++)
+				for (size_t k = 0; k < N; k++) {
+					const Vector3f& v = cube.at(i, j, k);
+					uint16_t* e = elements[i * N * N + j * N + k];
+
+					if (HCube<N>::isCube(v)) {
+						const uint64_t offset = HCube<N>::toOffset(v);
+
+						if (offset > 0xffffffffUL)
+							return false;
+
+						e[0] = cubeTag;
+						e[1] = offset & 0xffff;
+						e[2] = offset >> 16;
+					} else {
+						e[0] = floatToHalf(v.x * inverse);
+						e[1] = floatToHalf(v.y * inverse);
+						e[2] = floatToHalf(v.z * inverse);
+
+						const float d2 = HCubeElement<Vector3f>::length2(
+						        decode(e) - v, 0);
+
+						if (!(d2 <= error * error * HCubeElement<Vector3f>::length2(v, 0))
+						        && !(d2 <= threshold * threshold))
+							exceeded++;
+					}
+				}
+
+		return true;
+	}
+
+	HCubeStatus getValue(const Vector3f& position, float size,
+	                     Vector3f& value) const {
+		const float units = N / size;
+		float u = position.x * units;
+		float v = position.y * units;
+		float w = position.z * units;
+
+		if (!(u >= 0 && u < N && v >= 0 && v < N && w >= 0 && w < N)) {
+			value = Vector3f(0, 0, 0);
+			return HCubeInvalidPosition;
+		}
+
+		const HCubeHalf<N>* cube = this;
+
+		while (true) {
+			int i = std::min((int) u, (int) N - 1);
+			int j = std::min((int) v, (int) N - 1);
+			int k = std::min((int) w, (int) N - 1);
+			const uint16_t* e = cube->at(i, j, k);
+
+			if (!isCube(e)) {
+				value = cube->decode(e);
+				return HCubeValid;
+			}
+
+			cube = cube->toCube(e);
+			u = (u - i) * N;
+			v = (v - j) * N;
+			w = (w - k) * N;
+		}
+	}
+
+	Vector3f getValue(const Vector3f& position, float size) const {
+		Vector3f value;
+
+		if (getValue(position, size, value) != HCubeValid)
+			throw invalid_position();
+
+		return value;
+	}
+
+	size_t getCubeCount() const {
+		size_t count = 1;
+
+		for (size_t i = 0; i < N3; i++) {
+			if (isCube(elements[i]))
+				count += toCube(elements[i])->getCubeCount();
+		}
+
+		return count;
+	}
+};
+
+typedef HCubeHalf<2> HCubeHalf2;
+typedef HCubeHalf<4> HCubeHalf4;
+typedef HCubeHalf<8> HCubeHalf8;
+typedef HCubeHalf<16> HCubeHalf16;
+typedef HCubeHalf<32> HCubeHalf32;
+typedef HCubeHalf<64> HCubeHalf64;
+
+template<size_t N>
+class HCubeHalfFile: public MMapFile {
+
+	typedef HCubeHalf<N> hcube_t;
+
+	HCubeHeader _header;
+
+	void readHeader() {
+		if (size() < (off_t) sizeof(HCubeHeader))
+			throw std::runtime_error("[HCubeHalfFile] file has no header!");
+
+		read(_header, 0);
+
+		if (!_header.valid())
+			throw std::runtime_error("[HCubeHalfFile] file has no header!");
+		if (_header.version > HCubeHeader::version_current)
+			throw std::runtime_error("[HCubeHalfFile] unsupported file version!");
+		if (_header.n != N)
+			throw std::runtime_error("[HCubeHalfFile] file has different N!");
+		if (_header.encoding != HCubeHalfFloat)
+			throw std::runtime_error("[HCubeHalfFile] file has different encoding!");
+	}
+
+public:
+
+	HCubeHalfFile() {
+
+	}
+
+	HCubeHalfFile(const std::string& filename, MappingType mtype = Auto) :
+			MMapFile(filename, mtype) {
+		readHeader();
+	}
+
+	void open(const std::string& filename, MappingType mtype = Auto) {
+		MMapFile::open(filename, mtype);
+		readHeader();
+	}
+
+	const HCubeHalf<N>* hcube() {
+		return data<hcube_t>(HCubeHeader::dataOffset);
+	}
+
+	const HCubeHeader& header() const {
+		return _header;
+	}
+
+	size_t getCubeCount() const {
+		return _header.cubes;
+	}
+
+	// Converts the HCube file input, cube by cube. Elements are checked
+	// against the error and threshold of the input. If one misses them, the
+	// conversion fails when strict is set and is reported on std::cerr
+	// otherwise. A failed conversion leaves no output.
+	static bool create(const std::string& input, const std::string& output,
+	                   bool strict = true) {
+		HCubeFile<N> src(input, OnDemand);
+
+		if (!src.hasHeader())
+			throw std::runtime_error("[HCubeHalfFile] input needs a file header!");
+
+		const size_t count = src.getCubeCount();
+		MMapFileWrite mapping(output,
+		                      HCubeHeader::dataOffset + count * sizeof(hcube_t));
+		const HCube<N>* cubes = src.hcube();
+		hcube_t* half = (hcube_t*) ((char*) mapping.data()
+		                            + HCubeHeader::dataOffset);
+
+		const float error = src.header().error;
+		const float threshold = src.header().threshold;
+		bool valid = true, finite = true;
+		size_t exceeded = 0;
+
+		#pragma omp parallel for schedule(static, 1024) reduction(&&:valid, finite) reduction(+:exceeded)
+		for (size_t i = 0; i < count; i++)
+			valid = half[i].encode(cubes[i], error, threshold, finite, exceeded)
+			        && valid;
+
+		std::string failure;
+
+		if (!finite)
+			failure = "[HCubeHalfFile] input has elements that are not finite!";
+		else if (!valid)
+			failure = "[HCubeHalfFile] child offset exceeds 32 bit!";
+		else if (exceeded && strict)
+			failure = "[HCubeHalfFile] half precision exceeds the error of the input!";
+
+		if (!failure.empty()) {
+			std::remove(output.c_str());
+			throw std::runtime_error(failure);
+		}
+
+		if (exceeded)
+			std::cerr << "[HCubeHalfFile] " << exceeded
+			          << " elements exceed the error of the input." << std::endl;
+
+		HCubeHeader* header = new (mapping.data()) HCubeHeader(src.header());
+		header->encoding = HCubeHalfFloat;
+		header->means = 0;
+		header->updateChecksum();
+
+		return true;
+	}
+};
+
+typedef HCubeHalfFile<2> HCubeHalfFile2;
+typedef HCubeHalfFile<4> HCubeHalfFile4;
+typedef HCubeHalfFile<8> HCubeHalfFile8;
+typedef HCubeHalfFile<16> HCubeHalfFile16;
+typedef HCubeHalfFile<32> HCubeHalfFile32;
+typedef HCubeHalfFile<64> HCubeHalfFile64;
+
+} // namespace quimby
@@ -2,37 +2,245 @@
 
 #include "MagneticField.h"
 #include "HCube.h"
+#include "HCubeHalf.h"
 
-#include <sstream>
+#include <stdexcept>
+#ifndef SWIG
+#include <atomic>
+#include <memory>
+#endif
 
 namespace quimby {
 
+#ifndef SWIG
+struct HCubeCacheCounters {
+	std::atomic<size_t> hits, misses;
+
+	HCubeCacheCounters() :
+			hits(0), misses(0) {
+	}
+};
+
+// Leaf cell of the last lookup of a thread, shared by all fields. The box is
+// in the cell coordinates of HCube::lookup, so hits find its cells. owner is
+// the id of the field that filled it, ids are never reused. Hits and misses
+// are counted here and added to the counters of the owner in batches, when
+// the owner changes and when the thread exits.
+struct HCubeLeafCache {
+	size_t owner;
+	Vector3f lower, upper;
+	const Vector3f* value;
+	size_t hits, misses;
+	std::shared_ptr<HCubeCacheCounters> counters;
+
+	HCubeLeafCache() :
+			owner(0), value(0), hits(0), misses(0) {
+	}
+
+	~HCubeLeafCache() {
+		flush();
+	}
+
+	void flush() {
+		if (counters) {
+			counters->hits += hits;
+			counters->misses += misses;
+		}
+		hits = 0;
+		misses = 0;
+	}
+
+	static HCubeLeafCache& get() {
+		static thread_local HCubeLeafCache cache;
+		return cache;
+	}
+
+	static size_t nextOwner() {
+		static std::atomic<size_t> next(1);
+		return next++;
+	}
+};
+#endif
+
 template<size_t N>
 class HCubeMagneticField: public MagneticField {
 	ref_ptr<HCubeFile<N> > _hcfile;
+	bool interpolate;
+	size_t maxDepth;
+	bool cache;
+#ifndef SWIG
+	size_t cacheOwner;
+	std::shared_ptr<HCubeCacheCounters> cacheCounters;
+#endif
 public:
 	HCubeMagneticField(ref_ptr<HCubeFile<N> > hcube, const Vector3f &originKpc,
 			float sizeKpc) :
-			_hcfile(hcube) {
+			_hcfile(hcube), interpolate(false),
+			maxDepth(std::numeric_limits<size_t>::max()), cache(true),
+			cacheOwner(HCubeLeafCache::nextOwner()),
+			cacheCounters(new HCubeCacheCounters) {
 		_originKpc = originKpc;
 		_sizeKpc = sizeKpc;
 	}
 
+	// origin and size from the file header
+	HCubeMagneticField(ref_ptr<HCubeFile<N> > hcube) :
+			_hcfile(hcube), interpolate(false),
+			maxDepth(std::numeric_limits<size_t>::max()), cache(true),
+			cacheOwner(HCubeLeafCache::nextOwner()),
+			cacheCounters(new HCubeCacheCounters) {
+		if (!_hcfile->hasHeader())
+			throw std::runtime_error("[HCubeMagneticField] file has no header!");
+		_originKpc = _hcfile->header().origin;
+		_sizeKpc = _hcfile->header().size;
+	}
+
 	~HCubeMagneticField() {
 
 	}
 
+	// Blend the values of neighbouring cells instead of returning the value
+	// of the containing cell.
+	void setInterpolate(bool interpolate) {
+		this->interpolate = interpolate;
+	}
+
+	// Descend at most maxDepth levels, deeper cells return the mean of their
+	// subtree. Needs a file with means, see HCubeFile::appendMeans.
+	void setMaxDepth(size_t maxDepth) {
+		if (!_hcfile->means())
+			throw std::runtime_error("[HCubeMagneticField] file has no means!");
+		this->maxDepth = maxDepth;
+	}
+
+	// Remember the leaf cell of the last lookup per thread, lookups inside it
+	// return without descending. On by default, interpolating and depth
+	// limited lookups bypass it.
+	void setCache(bool cache) {
+		this->cache = cache;
+	}
+
+	// Hits and misses of the leaf cache. Threads add their counts every 1024
+	// lookups, when they use another field, when they exit or when they call
+	// flushCacheStatistics.
+	size_t getCacheHits() const {
+		return cacheCounters->hits;
+	}
+
+	size_t getCacheMisses() const {
+		return cacheCounters->misses;
+	}
+
+	void flushCacheStatistics() const {
+		HCubeLeafCache& leaf = HCubeLeafCache::get();
+		if (leaf.owner == cacheOwner)
+			leaf.flush();
+	}
+
 	bool getField(const Vector3f &position, Vector3f &b) const {
-        try {
-            b = _hcfile->hcube()->getValue(position - _originKpc, _sizeKpc);
-            return true;
-        } catch(invalid_position &e) {
-            std::ostringstream str;
-            str << "HCubeMagneticField: invalid position: (" << position << ") kpc.";
-            str << "Origin: (" << _originKpc << ") kpc.";
-            str << "Size: " << _sizeKpc << " kpc.";
-            throw std::runtime_error(str.str());
-        }  
+		const HCube<N> *hcube = _hcfile->hcube();
+		if (cache && !interpolate
+				&& maxDepth == std::numeric_limits<size_t>::max()) {
+			const Vector3f r = position - _originKpc;
+			const float scale = N / _sizeKpc;
+			const Vector3f u = r * scale;
+			HCubeLeafCache& leaf = HCubeLeafCache::get();
+
+			if (leaf.owner == cacheOwner && u.x >= leaf.lower.x
+					&& u.y >= leaf.lower.y && u.z >= leaf.lower.z
+					&& u.x < leaf.upper.x && u.y < leaf.upper.y
+					&& u.z < leaf.upper.z) {
+				b = *leaf.value;
+				if (++leaf.hits + leaf.misses >= 1024)
+					leaf.flush();
+				return true;
+			}
+
+			if (leaf.owner != cacheOwner) {
+				leaf.flush();
+				leaf.owner = cacheOwner;
+				leaf.counters = cacheCounters;
+			}
+
+			if (++leaf.misses + leaf.hits >= 1024)
+				leaf.flush();
+
+			const Vector3f *value;
+			if (hcube->lookup(r, _sizeKpc, value, leaf.lower, leaf.upper)
+					!= HCubeValid) {
+				leaf.upper = leaf.lower = Vector3f(0, 0, 0);
+				b = Vector3f(0, 0, 0);
+				return false;
+			}
+
+			leaf.value = value;
+			b = *value;
+			return true;
+		}
+		if (maxDepth != std::numeric_limits<size_t>::max())
+			return (hcube->getValue(position - _originKpc, _sizeKpc, maxDepth,
+					_hcfile->means(), b) == HCubeValid);
+		if (interpolate)
+			return (hcube->interpolate(position - _originKpc, _sizeKpc, b)
+					== HCubeValid);
+		return (hcube->getValue(position - _originKpc, _sizeKpc, b)
+				== HCubeValid);
+	}
+
+	// Field derivatives at the leaf resolution, see HCube::jacobian.
+	bool getJacobian(const Vector3f &position, HCubeJacobian &jacobian) const {
+		return (_hcfile->hcube()->jacobian(position - _originKpc, _sizeKpc,
+				jacobian) == HCubeValid);
+	}
+
+	// Integral of the field along the ray start + t * direction, t in
+	// [0, length], and the length of the ray inside the field. Returns false
+	// if the ray misses the field.
+	bool integrate(const Vector3f &start, const Vector3f &direction,
+			float length, Vector3f &integral, float &pathLength) const {
+		return (_hcfile->hcube()->integrate(start - _originKpc, direction,
+				length, _sizeKpc, integral, pathLength) == HCubeValid);
+	}
+
+	// Integrates n rays in parallel, false if any ray missed the field.
+	bool integrate(const Vector3f *start, const Vector3f *direction,
+			const float *length, size_t n, Vector3f *integral,
+			float *pathLength) const {
+		std::vector<Vector3f> relative(start, start + n);
+		for (size_t i = 0; i < n; i++)
+			relative[i] -= _originKpc;
+		return _hcfile->hcube()->integrate(relative.data(), direction, length,
+				n, _sizeKpc, integral, pathLength);
+	}
+
+	// Batched field lookup of n positions. Positions outside the field get a
+	// zero value, false is returned if there were any.
+	bool getValues(const float* x, const float* y, const float* z,
+			Vector3f* b, size_t n) const {
+		const size_t chunk = 256;
+		float rx[chunk], ry[chunk], rz[chunk];
+		const HCube<N>* hcube = _hcfile->hcube();
+		bool valid = true;
+
+		if (interpolate || maxDepth != std::numeric_limits<size_t>::max()) {
+			for (size_t i = 0; i < n; i++)
+				valid &= getField(Vector3f(x[i], y[i], z[i]), b[i]);
+			return valid;
+		}
+
+		for (size_t first = 0; first < n; first += chunk) {
+			const size_t count = std::min(chunk, n - first);
+
+			for (size_t i = 0; i < count; i++) {
+				rx[i] = x[first + i] - _originKpc.x;
+				ry[i] = y[first + i] - _originKpc.y;
+				rz[i] = z[first + i] - _originKpc.z;
+			}
+
+			valid &= hcube->getValues(rx, ry, rz, b + first, count, _sizeKpc);
+		}
+
+		return valid;
 	}
 
 };
@@ -44,4 +252,71 @@ typedef HCubeMagneticField<16> HCubeMagneticField16;
 typedef HCubeMagneticField<32> HCubeMagneticField32;
 typedef HCubeMagneticField<64> HCubeMagneticField64;
 
+template<size_t N>
+class HCubeHalfMagneticField: public MagneticField {
+	ref_ptr<HCubeHalfFile<N> > _hcfile;
+public:
+	HCubeHalfMagneticField(ref_ptr<HCubeHalfFile<N> > hcube) :
+			_hcfile(hcube) {
+		_originKpc = _hcfile->header().origin;
+		_sizeKpc = _hcfile->header().size;
+	}
+
+	bool getField(const Vector3f &position, Vector3f &b) const {
+		return (_hcfile->hcube()->getValue(position - _originKpc, _sizeKpc, b)
+				== HCubeValid);
+	}
+};
+
+typedef HCubeHalfMagneticField<2> HCubeHalfMagneticField2;
+typedef HCubeHalfMagneticField<4> HCubeHalfMagneticField4;
+typedef HCubeHalfMagneticField<8> HCubeHalfMagneticField8;
+typedef HCubeHalfMagneticField<16> HCubeHalfMagneticField16;
+typedef HCubeHalfMagneticField<32> HCubeHalfMagneticField32;
+typedef HCubeHalfMagneticField<64> HCubeHalfMagneticField64;
+
+// Opens an HCube file with header as field of the matching N and encoding.
+inline ref_ptr<MagneticField> openHCubeMagneticField(const std::string& filename,
+		MappingType mtype = Auto) {
+	HCubeHeader header;
+	if (!HCubeHeader::read(filename, header))
+		throw std::runtime_error("[HCubeMagneticField] no header: " + filename);
+
+	if (header.encoding == HCubeHalfFloat) {
+		switch (header.n) {
+		case 2:
+			return new HCubeHalfMagneticField2(new HCubeHalfFile2(filename, mtype));
+		case 4:
+			return new HCubeHalfMagneticField4(new HCubeHalfFile4(filename, mtype));
+		case 8:
+			return new HCubeHalfMagneticField8(new HCubeHalfFile8(filename, mtype));
+		case 16:
+			return new HCubeHalfMagneticField16(new HCubeHalfFile16(filename, mtype));
+		case 32:
+			return new HCubeHalfMagneticField32(new HCubeHalfFile32(filename, mtype));
+		case 64:
+			return new HCubeHalfMagneticField64(new HCubeHalfFile64(filename, mtype));
+		default:
+			throw std::runtime_error("[HCubeMagneticField] unsupported N: " + filename);
+		}
+	}
+
+	switch (header.n) {
+	case 2:
+		return new HCubeMagneticField2(new HCubeFile2(filename, mtype));
+	case 4:
+		return new HCubeMagneticField4(new HCubeFile4(filename, mtype));
+	case 8:
+		return new HCubeMagneticField8(new HCubeFile8(filename, mtype));
+	case 16:
+		return new HCubeMagneticField16(new HCubeFile16(filename, mtype));
+	case 32:
+		return new HCubeMagneticField32(new HCubeFile32(filename, mtype));
+	case 64:
+		return new HCubeMagneticField64(new HCubeFile64(filename, mtype));
+	default:
+		throw std::runtime_error("[HCubeMagneticField] unsupported N: " + filename);
+	}
+}
+
 } // namespace quimby
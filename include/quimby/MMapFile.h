@@ -3,6 +3,7 @@
 #include "Referenced.h"
 #include <sys/types.h>
 #include <string>
+#include <vector>
 
 namespace quimby {
 
@@ -29,6 +30,10 @@ public:
 	void open(const std::string& filename, MappingType mtype = Auto);
 	void close();
 
+	off_t size() const {
+		return _size;
+	}
+
 	template<class T>
 	const T* data(size_t offset = 0) {
 		return (const T*)((char *)_data + offset);
@@ -57,6 +62,65 @@ public:
 	void unmap() ;
 	void close();
 	void* data();
+
+	size_t size() const {
+		return _data_size;
+	}
 };
 
+// Positional writer with a bounded write back buffer. Consecutive writes are
+// collected and written with pwrite. Writeback of each written range is
+// started right away and waited for with the next one, after which the range
+// is dropped from the page cache. Neither the process nor the page cache hold
+// more than two buffers of the file.
+class BufferedFileWrite {
+private:
+	int _file;
+	std::vector<char> _buffer;
+	off_t _buffer_offset;
+	size_t _buffer_size;
+	off_t _pending_begin, _pending_end;
+
+	void writeback(off_t begin, off_t end);
+public:
+
+	BufferedFileWrite(const std::string& filename, size_t buffer_size = 64 << 20,
+	                  bool resume = false);
+	~BufferedFileWrite();
+
+	void write(off_t offset, const void* data, size_t size);
+	void read(off_t offset, void* data, size_t size);
+	void flush();
+	void sync();
+	void truncate(off_t size);
+	void close();
+
+	int descriptor() const {
+		return _file;
+	}
+};
+
+// Reader for single passes over files larger than memory. Ranges are read
+// with pread, the following range of the same size is announced with
+// POSIX_FADV_WILLNEED and the read range is dropped from the page cache.
+class StreamingFileRead {
+private:
+	int _file;
+	off_t _size;
+public:
+
+	StreamingFileRead(const std::string& filename);
+	~StreamingFileRead();
+
+	off_t size() const;
+	// the range announced next is before offset when backward is set
+	void read(off_t offset, void* data, size_t size, bool backward = false);
+	void close();
+};
+
+// Copies size bytes of input at input_offset into the existing file output at
+// output_offset, in the kernel with copy_file_range where available.
+bool copyFileRange(const std::string& input, off_t input_offset,
+                   const std::string& output, off_t output_offset, size_t size);
+
 } // namespace quimby
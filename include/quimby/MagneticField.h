@@ -58,7 +58,8 @@ public:
 
 	void dump(const std::string &dumpfilename);
 	bool restore(const std::string &dumpfilename);
-	void sampleParticle(const SmoothParticle &particle);
+	void sampleParticle(const SmoothParticle &particle,
+			const KernelPayload *payload = 0);
 	void setBroadeningFactor(double broadening);
 	void setInterpolate(bool interpolate);
 };
@@ -58,6 +58,11 @@ public:
 		return kernel(normalizedDistance);
 	}
 
+	// with the precomputed inverse smoothing length
+	float_t kernel(const vector_t &point, float_t invSmoothingLength) const {
+		return kernel((point - position).length() * invSmoothingLength);
+	}
+
 	float_t weight() const {
 		return 8. / (M_PI * smoothingLength * smoothingLength * smoothingLength);
 	}
@@ -71,6 +76,32 @@ public:
 	}
 };
 
+// SPH estimates deposited per particle and kernel value, the sum of
+// A m / rho W for a quantity A.
+inline Vector3f sampleBField(const SmoothParticle& p) {
+	return p.bfield * p.weight() * p.mass / p.rho;
+}
+
+inline float sampleDensity(const SmoothParticle& p) {
+	return p.weight() * p.mass;
+}
+
+// Per particle factors of the SPH sums, stored by databases created with a
+// kernel payload.
+struct KernelPayload {
+	Vector3f bfield;	// sampleBField
+	float density;	// sampleDensity
+	float invSmoothingLength;
+};
+
+inline KernelPayload kernelPayload(const SmoothParticle& p) {
+	KernelPayload k;
+	k.bfield = sampleBField(p);
+	k.density = sampleDensity(p);
+	k.invSmoothingLength = 1 / p.smoothingLength;
+	return k;
+}
+
 class SmoothParticleHelper {
 public:
 	static void updateRho(std::vector<SmoothParticle> &particles) {
@@ -27,7 +27,9 @@
 #include "quimby/SmoothParticle.h"
 #include "quimby/Vector3.h"
 #include "quimby/MMapFile.h"
+#include "quimby/HCubeElement.h"
 #include "quimby/HCube.h"
+#include "quimby/HCubeHalf.h"
 #include "quimby/HCubeMagneticField.h"
 #include "quimby/GadgetFile.h"
 %}
@@ -96,6 +98,7 @@ REF_PTR(DirectMagneticField, quimby::DirectMagneticField)
 %include "quimby/MagneticField.h"
 
 
+%include "quimby/HCubeElement.h"
 %include "quimby/HCube.h"
 %template(HCube2) quimby::HCube<2>;
 %template(HCube4) quimby::HCube<4>;
@@ -112,6 +115,21 @@ TPL_REF_PTR(HCubeFile32, quimby::HCubeFile<32>)
 TPL_REF_PTR(HCubeFile64, quimby::HCubeFile<64>)
 
 
+%include "quimby/HCubeHalf.h"
+%template(HCubeHalf2) quimby::HCubeHalf<2>;
+%template(HCubeHalf4) quimby::HCubeHalf<4>;
+%template(HCubeHalf8) quimby::HCubeHalf<8>;
+%template(HCubeHalf16) quimby::HCubeHalf<16>;
+%template(HCubeHalf32) quimby::HCubeHalf<32>;
+%template(HCubeHalf64) quimby::HCubeHalf<64>;
+
+TPL_REF_PTR(HCubeHalfFile2, quimby::HCubeHalfFile<2>)
+TPL_REF_PTR(HCubeHalfFile4, quimby::HCubeHalfFile<4>)
+TPL_REF_PTR(HCubeHalfFile8, quimby::HCubeHalfFile<8>)
+TPL_REF_PTR(HCubeHalfFile16, quimby::HCubeHalfFile<16>)
+TPL_REF_PTR(HCubeHalfFile32, quimby::HCubeHalfFile<32>)
+TPL_REF_PTR(HCubeHalfFile64, quimby::HCubeHalfFile<64>)
+
 %include "quimby/HCubeMagneticField.h"
 TPL_REF_PTR(HCubeMagneticField2, quimby::HCubeMagneticField<2>)
 TPL_REF_PTR(HCubeMagneticField4, quimby::HCubeMagneticField<4>)
@@ -119,6 +137,12 @@ TPL_REF_PTR(HCubeMagneticField8, quimby::HCubeMagneticField<8>)
 TPL_REF_PTR(HCubeMagneticField16, quimby::HCubeMagneticField<16>)
 TPL_REF_PTR(HCubeMagneticField32, quimby::HCubeMagneticField<32>)
 TPL_REF_PTR(HCubeMagneticField64, quimby::HCubeMagneticField<64>)
+TPL_REF_PTR(HCubeHalfMagneticField2, quimby::HCubeHalfMagneticField<2>)
+TPL_REF_PTR(HCubeHalfMagneticField4, quimby::HCubeHalfMagneticField<4>)
+TPL_REF_PTR(HCubeHalfMagneticField8, quimby::HCubeHalfMagneticField<8>)
+TPL_REF_PTR(HCubeHalfMagneticField16, quimby::HCubeHalfMagneticField<16>)
+TPL_REF_PTR(HCubeHalfMagneticField32, quimby::HCubeHalfMagneticField<32>)
+TPL_REF_PTR(HCubeHalfMagneticField64, quimby::HCubeHalfMagneticField<64>)
 
 %include "quimby/GadgetFile.h"
 REF_PTR(GadgetFile, quimby::GadgetFile)
@@ -127,6 +151,9 @@ REF_PTR(GadgetFile, quimby::GadgetFile)
 
 def loadHCubeMagneticField(cfgfile, modus=Auto):
     import json, os
+    if not cfgfile.endswith(".cfg"):
+        # HCube file with header
+        return openHCubeMagneticField(cfgfile.encode("utf-8"), modus)
     cfg = json.load(open(cfgfile))
     offset = Vector3f(float(cfg["offset"][0]),float(cfg["offset"][1]),float(cfg["offset"][2]))
     size = float(cfg["size"])
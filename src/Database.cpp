@@ -1,5 +1,9 @@
 #include "quimby/Database.h"
 
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <omp.h>
 #include <stdexcept>
 
 namespace quimby {
@@ -17,6 +21,7 @@ inline T clamp(const T &value, const T &min, const T&max) {
 }
 
 class _CollectVisitor: public DatabaseVisitor {
+	vector<SmoothParticle> collected;
 	vector<SmoothParticle> &particles;
 	Vector3f lower, upper;
 public:
@@ -26,10 +31,25 @@ public:
 			particles(particles), lower(lower), upper(upper), count(0) {
 	}
 
+	_CollectVisitor(const Vector3f &lower, const Vector3f &upper) :
+			particles(collected), lower(lower), upper(upper), count(0) {
+	}
+
 	void begin(const Database &db) {
 		count = 0;
 	}
 
+	DatabaseVisitor *clone() const {
+		return new _CollectVisitor(lower, upper);
+	}
+
+	void reduce(DatabaseVisitor &clone) {
+		_CollectVisitor &c = (_CollectVisitor &) clone;
+		particles.insert(particles.end(), c.particles.begin(),
+				c.particles.end());
+		count += c.count;
+	}
+
 	void visit(const SmoothParticle &particle) {
 		count++;
 		particles.push_back(particle);
@@ -37,6 +57,13 @@ public:
 
 	bool intersects(const Vector3f &lower, const Vector3f &upper,
 			float margin) {
+		return AABB<float>(this->lower, this->upper).intersects(
+				lower - Vector3f(margin), upper + Vector3f(margin));
+	}
+
+	bool getBounds(Vector3f &lower, Vector3f &upper) {
+		lower = this->lower;
+		upper = this->upper;
 		return true;
 	}
 
@@ -53,9 +80,17 @@ size_t SimpleSamplingVisitor::toUpperIndex(double x) {
 	return (size_t) clamp((int) ::ceil(x / cell), (int) 0, (int) N - 1);
 }
 
+static void sampleBFieldChannels(const SmoothParticle &particle,
+		const KernelPayload *payload, float *value) {
+	Vector3f b = payload ? payload->bfield : sampleBField(particle);
+	value[0] = b.x;
+	value[1] = b.y;
+	value[2] = b.z;
+}
+
 SimpleSamplingVisitor::SimpleSamplingVisitor(Vector3f *data, size_t N,
 		const Vector3f &offset, float size) :
-		data(data), N(N), offset(offset), size(size), progress(false), count(0), xmin(
+		data(&data->x), channels(3), attribute(sampleBFieldChannels), N(N), count(0), offset(offset), size(size), progress(false), firstSlab(true), xmin(
 				0), xmax(N - 1), ymin(0), ymax(N - 1), zmin(0), zmax(N - 1), box(
 				offset, offset + Vector3f(size)) {
 	cell = size / N;
@@ -63,9 +98,20 @@ SimpleSamplingVisitor::SimpleSamplingVisitor(Vector3f *data, size_t N,
 
 SimpleSamplingVisitor::SimpleSamplingVisitor(Grid<Vector3f> &grid,
 		const Vector3f &offset, float size) :
-		data(grid.elements.data()), N(grid.bins), offset(offset), size(size), progress(false), count(0), xmin(
+		data(&grid.elements.data()->x), channels(3), attribute(sampleBFieldChannels), N(grid.bins), count(0), offset(offset), size(size), progress(false), firstSlab(true), xmin(
+				0), xmax(N - 1), ymin(0), ymax(N - 1), zmin(0), zmax(N - 1), box(
+				offset, offset + Vector3f(size)) {
+	cell = size / N;
+}
+
+SimpleSamplingVisitor::SimpleSamplingVisitor(float *data, size_t channels,
+		SamplingAttribute attribute, size_t N, const Vector3f &offset,
+		float size) :
+		data(data), channels(channels), attribute(attribute), N(N), count(0), offset(offset), size(size), progress(false), firstSlab(true), xmin(
 				0), xmax(N - 1), ymin(0), ymax(N - 1), zmin(0), zmax(N - 1), box(
 				offset, offset + Vector3f(size)) {
+	if (channels > 16)
+		throw runtime_error("[SimpleSamplingVisitor] too many channels!");
 	cell = size / N;
 }
 
@@ -78,7 +124,36 @@ void SimpleSamplingVisitor::limit(size_t xmin, size_t xmax, size_t ymin,
 	this->zmin = clamp(zmin, (size_t) 0, N - 1);
 	this->zmax = clamp(zmax, (size_t) 0, N - 1);
 	box.min = offset + Vector3f(cell * this->xmin, cell * this->ymin, cell * this->zmin);
-	box.max = offset + Vector3f(cell * this->xmax, cell * this->ymax, cell * this->zmax);
+	box.max = offset + Vector3f(cell * (this->xmax + 1), cell * (this->ymax + 1),
+			cell * (this->zmax + 1));
+}
+
+void SimpleSamplingVisitor::sample(const Database &db) {
+	// inside a parallel region the slabs would run one after another, each
+	// reading the blocks of its margin again
+	if (omp_in_parallel() || omp_get_max_threads() == 1) {
+		db.accept(*this);
+		return;
+	}
+
+	const size_t cells = xmax - xmin + 1;
+	const size_t slabs = std::min(cells, (size_t) 4 * omp_get_max_threads());
+	size_t total = 0;
+
+	// the slabs write disjoint cells, visiting the same blocks in the same
+	// order as a serial traversal
+	#pragma omp parallel for schedule(dynamic, 1) reduction(+:total)
+	for (long s = 0; s < (long) slabs; s++) {
+		SimpleSamplingVisitor slab(*this);
+		slab.progress = false;
+		slab.firstSlab = (s == 0);
+		slab.limit(xmin + s * cells / slabs, xmin + (s + 1) * cells / slabs - 1,
+				ymin, ymax, zmin, zmax);
+		db.accept(slab);
+		total += slab.count;
+	}
+
+	count = total;
 }
 
 bool SimpleSamplingVisitor::intersects(const Vector3f &lower,
@@ -86,6 +161,38 @@ bool SimpleSamplingVisitor::intersects(const Vector3f &lower,
 	return box.intersects(lower - Vector3f(margin), upper + Vector3f(margin));
 }
 
+bool SimpleSamplingVisitor::getBounds(Vector3f &lower, Vector3f &upper) {
+	lower = box.min;
+	upper = box.max;
+	return true;
+}
+
+DatabaseVisitor *SimpleSamplingVisitor::clone() const {
+	SimpleSamplingVisitor *c = new SimpleSamplingVisitor(*this);
+	c->buffer.assign(N * N * N * channels, 0);
+	c->data = &c->buffer[0];
+	c->progress = false;
+	c->count = 0;
+	return c;
+}
+
+void SimpleSamplingVisitor::reduce(DatabaseVisitor &clone) {
+	const SimpleSamplingVisitor &c = (const SimpleSamplingVisitor &) clone;
+	const size_t N2 = N * N;
+
+	#pragma omp parallel for
+	for (long x = xmin; x <= (long) xmax; x++) {
+		for (size_t y = ymin; y <= ymax; y++) {
+			const size_t first = (x * N2 + y * N + zmin) * channels;
+			const size_t last = (x * N2 + y * N + zmax + 1) * channels;
+			for (size_t i = first; i < last; i++)
+				data[i] += c.data[i];
+		}
+	}
+
+	count += c.count;
+}
+
 void SimpleSamplingVisitor::showProgress(bool progress) {
 	this->progress = progress;
 }
@@ -98,16 +205,37 @@ size_t SimpleSamplingVisitor::getCount() {
 	return count;
 }
 
-void SimpleSamplingVisitor::visit(const SmoothParticle &part) {
+void SimpleSamplingVisitor::visitBlock(const SmoothParticle *particles,
+		const KernelPayload *payload, size_t n) {
+	const Vector3f &l = box.min, &u = box.max;
+	for (size_t i = 0; i < n; i++) {
+		const SmoothParticle &p = particles[i];
+		const float h = p.smoothingLength;
+		if (p.position.x + h >= l.x && p.position.x - h <= u.x
+				&& p.position.y + h >= l.y && p.position.y - h <= u.y
+				&& p.position.z + h >= l.z && p.position.z - h <= u.z)
+			deposit(p, payload ? payload + i : 0);
+	}
+}
+
+void SimpleSamplingVisitor::visit(const SmoothParticle &particle) {
+	deposit(particle, 0);
+}
+
+void SimpleSamplingVisitor::deposit(const SmoothParticle &particle,
+		const KernelPayload *payload) {
 	const size_t N2 = N * N;
-	count++;
 
-	SmoothParticle particle = part;
+	// the particle reaches the previous slab too, which counts it
+	if (firstSlab || particle.position.x - particle.smoothingLength > box.min.x)
+		count++;
+
 //			particle.smoothingLength += _broadeningFactor
 //					* _grid.getCellLength();
 
-	Vector3f value = particle.bfield * particle.weight() * particle.mass
-			/ particle.rho;
+	float value[16];
+	attribute(particle, payload, value);
+	const float invSmoothingLength = payload ? payload->invSmoothingLength : 0;
 	float r = particle.smoothingLength + cell;
 
 	Vector3f relativePosition = particle.position - offset;
@@ -127,8 +255,8 @@ void SimpleSamplingVisitor::visit(const SmoothParticle &part) {
 	z_max = clamp(z_max, zmin, zmax);
 
 	Vector3f o = offset + Vector3f(cell / 2);
-	
-#pragma omp parallel for
+
+	// serial per particle, sample and acceptParallel run in parallel
 	for (size_t x = x_min; x <= x_max; x++) {
 		Vector3f p;
 		p.x = x * cell;
@@ -136,8 +264,11 @@ void SimpleSamplingVisitor::visit(const SmoothParticle &part) {
 			p.y = y * cell;
 			for (size_t z = z_min; z <= z_max; z++) {
 				p.z = z * cell;
-				float k = particle.kernel(o + p);
-				data[x * N2 + y * N + z] += value * k;
+				float k = payload ? particle.kernel(o + p, invSmoothingLength)
+						: particle.kernel(o + p);
+				float *d = data + (x * N2 + y * N + z) * channels;
+				for (size_t c = 0; c < channels; c++)
+					d[c] += value[c] * k;
 			}
 		}
 	}
@@ -158,18 +289,21 @@ void SimpleSamplingVisitor::end() {
 }
 
 size_t Database::getParticles(const Vector3f &lower, const Vector3f &upper,
-		vector<SmoothParticle> &particles) const {
+		vector<SmoothParticle> &particles, bool parallel) const {
 	_CollectVisitor v(particles, lower, upper);
-	accept(v);
+	if (parallel)
+		acceptParallel(v);
+	else
+		accept(v);
 	return v.count;
 }
 
 FileDatabase::FileDatabase() :
-		count(0), blocks_per_axis(0) {
+		count(0), blocks_per_axis(0), margin(0), particles(0), soa(false) {
 }
 
 FileDatabase::FileDatabase(const string &filename, MappingType mtype) :
-		count(0), blocks_per_axis(0) {
+		count(0), blocks_per_axis(0), margin(0), particles(0), soa(false) {
 	if (!open(filename, mtype))
 		throw runtime_error("[FileDatabase] could not open database file!");
 }
@@ -178,19 +312,167 @@ bool FileDatabase::open(const string &filename, MappingType mtype) {
 	this->filename = filename;
 	file.open(filename);
 	size_t offset = 0;
-	offset = file.read(count, offset);
-	offset = file.read(lower, offset);
-	offset = file.read(upper, offset);
-	offset = file.read(blocks_per_axis, offset);
+
+	SoAHeader header;
+	soa = file.size() >= (off_t) sizeof(SoAHeader)
+			&& memcmp(file.data<char>(), "QBDBSOA", 8) == 0;
+
+	payload = false;
+	if (soa) {
+		offset = file.read(header, offset);
+		if (header.version != 2 && header.version != 3)
+			throw runtime_error("[FileDatabase] unsupported file version!");
+		payload = (header.version == 3);
+		count = header.count;
+		lower = header.lower;
+		upper = header.upper;
+		blocks_per_axis = header.blocks_per_axis;
+	} else {
+		offset = file.read(count, offset);
+		offset = file.read(lower, offset);
+		offset = file.read(upper, offset);
+		offset = file.read(blocks_per_axis, offset);
+	}
+
 	blocks.resize(blocks_per_axis * blocks_per_axis * blocks_per_axis);
-	for (size_t i = 0; i < blocks.size(); i++)
+	margin = 0;
+	for (size_t i = 0; i < blocks.size(); i++) {
 		offset = file.read(blocks[i], offset);
+		margin = std::max(margin, blocks[i].margin);
+	}
+
+	if (soa) {
+		offset = (offset + 63) & ~(size_t) 63;
+		for (size_t a = 0; a < soaArrays; a++)
+			arrays[a] = (a < soaParticleArrays || payload) ?
+					file.data<float>(offset + a * header.capacity * sizeof(float)) : 0;
+		particles = 0;
+	} else {
+		particles = file.data<SmoothParticle>(offset);
+	}
 
-	particles = file.data<SmoothParticle>(offset);
-	
 	return true;
 }
 
+bool FileDatabase::isSoA() const {
+	return soa;
+}
+
+bool FileDatabase::hasPayload() const {
+	return payload;
+}
+
+size_t FileDatabase::gather(const Block &block, size_t first, bool bounded,
+		const Vector3f &query_lower, const Vector3f &query_upper,
+		SmoothParticle *out, KernelPayload *out_payload) const {
+	const size_t n = std::min((size_t) soaChunk, block.count - first);
+	const size_t start = block.start + first;
+	const float *x = arrays[soaX] + start, *y = arrays[soaY] + start;
+	const float *z = arrays[soaZ] + start, *h = arrays[soaH] + start;
+	unsigned char inside[soaChunk];
+
+	if (bounded) {
+		const Vector3f &l = query_lower, &u = query_upper;
+		#pragma omp simd
+		for (size_t i = 0; i < n; i++)
+			inside[i] = (x[i] + h[i] >= l.x) & (x[i] - h[i] <= u.x)
+					& (y[i] + h[i] >= l.y) & (y[i] - h[i] <= u.y)
+					& (z[i] + h[i] >= l.z) & (z[i] - h[i] <= u.z);
+	} else {
+		memset(inside, 1, n);
+	}
+
+	size_t m = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (!inside[i])
+			continue;
+		const size_t j = start + i;
+		SmoothParticle &p = out[m++];
+		p.position = Vector3f(x[i], y[i], z[i]);
+		p.smoothingLength = h[i];
+		p.bfield = Vector3f(arrays[soaBX][j], arrays[soaBY][j], arrays[soaBZ][j]);
+		p.mass = arrays[soaMass][j];
+		p.rho = arrays[soaRho][j];
+		if (out_payload) {
+			KernelPayload &k = out_payload[m - 1];
+			k.bfield = Vector3f(arrays[soaKX][j], arrays[soaKY][j],
+					arrays[soaKZ][j]);
+			k.density = arrays[soaKDensity][j];
+			k.invSmoothingLength = arrays[soaKInvH][j];
+		}
+	}
+
+	return m;
+}
+
+void FileDatabase::createSoA(const string &input, const string &output,
+		bool payload) {
+	FileDatabase db(input);
+	if (db.soa)
+		throw runtime_error("[FileDatabase] input is already version 2!");
+
+	// blocks start at multiples of 8 particles
+	vector<Block> blocks(db.blocks);
+	uint64_t capacity = 0;
+	for (size_t i = 0; i < blocks.size(); i++) {
+		blocks[i].start = capacity;
+		capacity += (blocks[i].count + 7) & ~7u;
+	}
+	capacity = (capacity + 15) & ~(uint64_t) 15;
+
+	SoAHeader header;
+	memcpy(header.magic, "QBDBSOA", 8);
+	header.version = payload ? 3 : 2;
+	header.count = db.count;
+	header.lower = db.lower;
+	header.upper = db.upper;
+	header.blocks_per_axis = db.blocks_per_axis;
+	header.capacity = capacity;
+
+	ofstream out(output.c_str(), ios::binary);
+	out.write((const char *) &header, sizeof(header));
+	for (size_t i = 0; i < blocks.size(); i++)
+		out.write((const char *) &blocks[i], sizeof(Block));
+	size_t offset = sizeof(header) + blocks.size() * sizeof(Block);
+	vector<char> zeros(64, 0);
+	out.write(&zeros[0], ((offset + 63) & ~(size_t) 63) - offset);
+
+	// one pass over the input per array
+	vector<float> values;
+	const size_t array_count = payload ? soaArrays : soaParticleArrays;
+	for (size_t a = 0; a < array_count; a++) {
+		uint64_t written = 0;
+		for (size_t i = 0; i < blocks.size(); i++) {
+			const Block &block = db.blocks[i];
+			values.assign((block.count + 7) & ~7u, 0.f);
+			for (size_t j = 0; j < block.count; j++) {
+				const SmoothParticle &p = db.particles[block.start + j];
+				if (a < soaParticleArrays) {
+					const float v[soaParticleArrays] = { p.position.x,
+							p.position.y, p.position.z, p.smoothingLength,
+							p.bfield.x, p.bfield.y, p.bfield.z, p.mass, p.rho };
+					values[j] = v[a];
+				} else {
+					const KernelPayload k = kernelPayload(p);
+					const float v[soaArrays - soaParticleArrays] = { k.bfield.x,
+							k.bfield.y, k.bfield.z, k.density,
+							k.invSmoothingLength };
+					values[j] = v[a - soaParticleArrays];
+				}
+			}
+			if (values.size())
+				out.write((const char *) &values[0], values.size() * sizeof(float));
+			written += values.size();
+		}
+		values.assign(capacity - written, 0.f);
+		if (values.size())
+			out.write((const char *) &values[0], values.size() * sizeof(float));
+	}
+
+	if (!out)
+		throw runtime_error("[FileDatabase] error writing file: " + output);
+}
+
 void FileDatabase::close() {
 	file.close();
 	count = 0;
@@ -206,10 +488,6 @@ Vector3f FileDatabase::getUpperBounds() const {
 }
 
 float FileDatabase::getMargin() const {
-	float margin = 0;
-	for (size_t i = 0; i < blocks.size(); i++) {
-		margin = std::max(margin, blocks[i].margin);
-	}
 	return margin;
 }
 
@@ -217,43 +495,94 @@ size_t FileDatabase::getCount() const {
 	return count;
 }
 
+size_t FileDatabase::toBlockIndex(float x, float lower, float blockSize) const {
+	if (!(blockSize > 0))
+		return 0;
+	double i = ::floor((x - lower) / blockSize);
+	return (size_t) clamp(i, 0., (double) blocks_per_axis - 1);
+}
+
+bool FileDatabase::blockRange(bool bounded, const Vector3f &query_lower,
+		const Vector3f &query_upper, size_t *first, size_t *last) const {
+	Vector3f blockSize = (upper - lower) / blocks_per_axis;
+
+	for (size_t a = 0; a < 3; a++) {
+		first[a] = 0;
+		last[a] = blocks_per_axis - 1;
+	}
+
+	if (!bounded)
+		return true;
+
+	// blocks overlapping the bounds of the visitor, with the largest margin
+	// and one block more for particles on block borders
+	const float *ql = &query_lower.x, *qu = &query_upper.x;
+	const float *l = &lower.x, *u = &upper.x, *bs = &blockSize.x;
+	for (size_t a = 0; a < 3; a++) {
+		if (qu[a] + margin < l[a] || ql[a] - margin > u[a])
+			return false;
+		first[a] = toBlockIndex(ql[a] - margin, l[a], bs[a]);
+		last[a] = toBlockIndex(qu[a] + margin, l[a], bs[a]);
+		if (first[a] > 0)
+			first[a]--;
+		if (last[a] + 1 < blocks_per_axis)
+			last[a]++;
+	}
+
+	return true;
+}
+
 void FileDatabase::accept(DatabaseVisitor &visitor) const {
+	accept<DatabaseVisitor>(visitor);
+}
+
+void FileDatabase::acceptParallel(DatabaseVisitor &visitor) const {
 	if (count == 0)
 		return;
 
-	Vector3f blockSize = (upper - lower) / blocks_per_axis;
-	Vector3f box_lower, box_upper;
+	Vector3f query_lower, query_upper;
+	size_t first[3], last[3];
+	bool bounded = visitor.getBounds(query_lower, query_upper);
+	bool any = blockRange(bounded, query_lower, query_upper, first, last);
 
 	visitor.begin(*this);
 
-	for (size_t iX = 0; iX < blocks_per_axis; iX++) {
-		box_lower.x = lower.x + iX * blockSize.x;
-		box_upper.x = box_lower.x + blockSize.x;
-		for (size_t iY = 0; iY < blocks_per_axis; iY++) {
-			box_lower.y = lower.y + iY * blockSize.y;
-			box_upper.y = box_lower.y + blockSize.y;
-			for (size_t iZ = 0; iZ < blocks_per_axis; iZ++) {
-				box_lower.z = lower.z + iZ * blockSize.z;
-				box_upper.z = box_lower.z + blockSize.z;
-				const Block &block = blocks[iX * blocks_per_axis
-						* blocks_per_axis + iY * blocks_per_axis + iZ];
-
-				if (!visitor.intersects(box_lower, box_upper, block.margin))
-					continue;
-
-				for (size_t i = 0; i < block.count; i++) {
-					SmoothParticle particle = particles[block.start + i];
-					Vector3f l = particle.position
-							- Vector3f(particle.smoothingLength);
-					Vector3f u = particle.position
-							+ Vector3f(particle.smoothingLength);
-					AABB<float> v(l, u);
-					if (visitor.intersects(particle.position, particle.position,
-							particle.smoothingLength))
-						visitor.visit(particle);
-				}
-			}
+	// one clone per thread, block columns are handed out dynamically. Clones
+	// are reduced in thread order.
+	vector<DatabaseVisitor *> clones(omp_get_max_threads(), 0);
+	bool cloned = true;
+	for (size_t t = 0; t < clones.size() && cloned; t++)
+		cloned = (clones[t] = visitor.clone()) != 0;
+
+	const size_t columnsY = last[1] - first[1] + 1;
+	const long columns = any ? (last[0] - first[0] + 1) * columnsY : 0;
+
+	if (cloned) {
+		#pragma omp parallel for schedule(dynamic, 1)
+		for (long c = 0; c < columns; c++) {
+			DatabaseVisitor &clone = *clones[omp_get_thread_num()];
+			size_t iX = first[0] + c / columnsY;
+			size_t iY = first[1] + c % columnsY;
+			for (size_t iZ = first[2]; iZ <= last[2]; iZ++)
+				acceptBlock(clone, iX, iY, iZ, bounded, query_lower,
+						query_upper);
 		}
+	} else {
+		for (size_t iX = first[0]; any && iX <= last[0]; iX++)
+			for (size_t iY = first[1]; iY <= last[1]; iY++)
+				for (size_t iZ = first[2]; iZ <= last[2]; iZ++)
+					acceptBlock(visitor, iX, iY, iZ, bounded, query_lower,
+							query_upper);
+	}
+
+	for (size_t t = 0; t < clones.size(); t++) {
+		if (!clones[t])
+			continue;
+		if (cloned) {
+			clones[t]->end();
+			visitor.reduce(*clones[t]);
+		}
+		delete clones[t];
 	}
 
 	visitor.end();
@@ -281,7 +610,23 @@ public:
 };
 
 void FileDatabase::create(vector<SmoothParticle> &particles,
-		const string &filename, size_t blocks_per_axis, bool verbose) {
+		const string &filename, size_t blocks_per_axis, bool verbose,
+		unsigned int version) {
+	if (version < 1 || version > 3)
+		throw runtime_error("[FileDatabase] unknown version!");
+
+	if (version > 1) {
+		string v1 = filename + ".v1";
+		create(particles, v1, blocks_per_axis, verbose);
+		try {
+			createSoA(v1, filename, version == 3);
+		} catch (...) {
+			remove(v1.c_str());
+			throw;
+		}
+		remove(v1.c_str());
+		return;
+	}
 
 	if (verbose)
 		cout << "Create FileDatabase '" << filename << "' ..." << endl;
@@ -348,8 +693,9 @@ void FileDatabase::create(vector<SmoothParticle> &particles,
 
 		first_in_x = first_out_x;
 
-		// find all particles in X bin
-		for (size_t i = first_in_x; i < count; i++) {
+		// find all particles in X bin, the last bin takes the rest
+		first_out_x = count;
+		for (size_t i = first_in_x; i < count && iX + 1 < blocks_per_axis; i++) {
 			float px = particles[i].position.x;
 			if (px > box_upper.x) {
 				first_out_x = i;
@@ -374,7 +720,9 @@ void FileDatabase::create(vector<SmoothParticle> &particles,
 			first_in_y = first_out_y;
 
 			// find all particles in Y bin
-			for (size_t i = first_in_y; i < first_out_x; i++) {
+			first_out_y = first_out_x;
+			for (size_t i = first_in_y; i < first_out_x && iY + 1 < blocks_per_axis;
+					i++) {
 				float py = particles[i].position.y;
 				if (py > box_upper.y) {
 					first_out_y = i;
@@ -393,8 +741,10 @@ void FileDatabase::create(vector<SmoothParticle> &particles,
 
 				first_in_z = first_out_z;
 
-				// find all particles in Y bin
-				for (size_t i = first_in_z; i < first_out_y; i++) {
+				// find all particles in Z bin
+				first_out_z = first_out_y;
+				for (size_t i = first_in_z;
+						i < first_out_y && iZ + 1 < blocks_per_axis; i++) {
 					float pz = particles[i].position.z;
 					if (pz > box_upper.z) {
 						first_out_z = i;
@@ -474,10 +824,26 @@ void Databases::update() {
 
 class DatabasesVisitorAdapter: public DatabaseVisitor {
 	DatabaseVisitor &visitor;
+	DatabaseVisitor *owned;
 public:
-	DatabasesVisitorAdapter(DatabaseVisitor &visitor) :
-			visitor(visitor) {
+	DatabasesVisitorAdapter(DatabaseVisitor &visitor, DatabaseVisitor *owned = 0) :
+			visitor(visitor), owned(owned) {
+
+	}
+
+	~DatabasesVisitorAdapter() {
+		delete owned;
+	}
 
+	DatabaseVisitor *clone() const {
+		DatabaseVisitor *c = visitor.clone();
+		return c ? new DatabasesVisitorAdapter(*c, c) : 0;
+	}
+
+	void reduce(DatabaseVisitor &clone) {
+		DatabaseVisitor *c = ((DatabasesVisitorAdapter &) clone).owned;
+		c->end();
+		visitor.reduce(*c);
 	}
 
 	virtual void begin(const Database &db) {
@@ -487,11 +853,20 @@ public:
 		visitor.visit(p);
 	}
 
+	void visitBlock(const SmoothParticle *particles,
+			const KernelPayload *payload, size_t n) {
+		visitor.visitBlock(particles, payload, n);
+	}
+
 	bool intersects(const Vector3f &lower, const Vector3f &upper,
 			float margin) {
 		return visitor.intersects(lower, upper, margin);
 	}
 
+	bool getBounds(Vector3f &lower, Vector3f &upper) {
+		return visitor.getBounds(lower, upper);
+	}
+
 	virtual void end() {
 	}
 };
@@ -508,6 +883,18 @@ void Databases::accept(DatabaseVisitor &visitor) const {
 	visitor.end();
 }
 
+void Databases::acceptParallel(DatabaseVisitor &visitor) const {
+	visitor.begin(*this);
+	DatabasesVisitorAdapter v(visitor);
+	for (iter_t i = databases.begin(); i != databases.end(); i++) {
+		Database *db = *i;
+		if (v.intersects(db->getLowerBounds(), db->getUpperBounds(),
+				db->getMargin()))
+			db->acceptParallel(v);
+	}
+	visitor.end();
+}
+
 float Databases::getMargin() const {
 	float margin = 0;
 	for (iter_t i = databases.begin(); i != databases.end(); i++) {
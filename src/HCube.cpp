@@ -0,0 +1,293 @@
+#include "quimby/HCube.h"
+
+#include <unordered_set>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// runtime dispatch to the widest vector unit, ifunc based
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && (__GNUC__ >= 6)
+#define QUIMBY_TARGET_CLONES __attribute__((target_clones("avx512f", "avx2", "sse4.2", "default")))
+#else
+#define QUIMBY_TARGET_CLONES
+#endif
+
+namespace quimby {
+
+QUIMBY_TARGET_CLONES
+bool collapseElements(const float* elements, size_t count, float error,
+                      float threshold, float* mean) {
+	float sx = 0, sy = 0, sz = 0;
+	int cubes = 0;
+
+	// child references are masked out instead of ending the loop early
+	#pragma omp simd reduction(+:sx,sy,sz) reduction(|:cubes)
+	for (size_t i = 0; i < count; i++) {
+		const float x = elements[3 * i];
+		const float y = elements[3 * i + 1];
+		const float z = elements[3 * i + 2];
+		const int cube = (x != x);
+		cubes |= cube;
+		sx += cube ? 0.f : x;
+		sy += cube ? 0.f : y;
+		sz += cube ? 0.f : z;
+	}
+
+	const float mx = sx / count;
+	const float my = sy / count;
+	const float mz = sz / count;
+	mean[0] = mx;
+	mean[1] = my;
+	mean[2] = mz;
+
+	if (cubes)
+		return false;
+
+	float max2 = 0;
+
+	#pragma omp simd reduction(max:max2)
+	for (size_t i = 0; i < count; i++) {
+		const float dx = elements[3 * i] - mx;
+		const float dy = elements[3 * i + 1] - my;
+		const float dz = elements[3 * i + 2] - mz;
+		const float d2 = dx * dx + dy * dy + dz * dz;
+		max2 = (d2 > max2) ? d2 : max2;
+	}
+
+	const float e2 = error * error * (mx * mx + my * my + mz * mz);
+	const float t2 = threshold * threshold;
+
+	return (max2 <= e2) || (max2 <= t2);
+}
+
+static const char checkpointMagic[8] = {'Q', 'B', 'H', 'C', 'C', 'K', 'P', '1'};
+
+void HCubeInitCheckpoint::Record::updateChecksum() {
+	checksum = MurmurHash2(this, offsetof(Record, checksum), 0);
+}
+
+bool HCubeInitCheckpoint::Record::valid() const {
+	return checksum == MurmurHash2(this, offsetof(Record, checksum), 0);
+}
+
+HCubeInitCheckpoint::HCubeInitCheckpoint(const std::string& filename,
+                                         size_t batch, time_t interval) :
+	file(-1), batch(batch), interval(interval), synced(0), sync_data(0),
+	sync_size(0), sync_file(-1) {
+	init(filename);
+}
+
+HCubeInitCheckpoint::~HCubeInitCheckpoint() {
+	flush();
+
+	if (file != -1)
+		::close(file);
+}
+
+void HCubeInitCheckpoint::init(const std::string& filename) {
+	if (file != -1) {
+		flush();
+		::close(file);
+	}
+
+	indices.clear();
+	file = ::open(filename.c_str(), O_RDWR | O_CREAT | O_APPEND, 0666);
+
+	if (file == -1)
+		throw std::runtime_error("[HCubeInitCheckpoint] error opening file: " + filename);
+
+	// load records up to the first invalid one
+	const off_t size = ::lseek(file, 0, SEEK_END);
+	off_t length = 0;
+	char magic[sizeof(checkpointMagic)];
+
+	if (size >= (off_t) sizeof(magic)
+	        && ::pread(file, magic, sizeof(magic), 0) == sizeof(magic)
+	        && memcmp(magic, checkpointMagic, sizeof(magic)) == 0) {
+		length = sizeof(magic);
+		std::vector<Record> records((size - length) / sizeof(Record));
+		size_t bytes = records.size() * sizeof(Record);
+		char* p = (char*) records.data();
+
+		for (off_t offset = length; bytes;) {
+			ssize_t n = ::pread(file, p, bytes, offset);
+
+			if (n <= 0)
+				break;
+
+			p += n;
+			offset += n;
+			bytes -= n;
+		}
+
+		records.resize((records.size() * sizeof(Record) - bytes) / sizeof(Record));
+		indices.reserve(records.size());
+
+		for (size_t i = 0; i < records.size() && records[i].valid(); i++) {
+			const Record& r = records[i];
+			const Key k = {r.cells, r.x, r.y, r.z};
+
+			if (r.end)
+				indices[k] = r.end;
+			else
+				erase(std::vector<Key>(1, k));
+
+			length += sizeof(Record);
+		}
+	}
+
+	// drop a torn tail or start a new file
+	if (length < size && ftruncate(file, length) == -1)
+		throw std::runtime_error("[HCubeInitCheckpoint] error truncating file!");
+
+	if (length == 0 && ::write(file, checkpointMagic, sizeof(checkpointMagic))
+	        != sizeof(checkpointMagic))
+		throw std::runtime_error("[HCubeInitCheckpoint] error writing file!");
+
+	synced = time(0);
+}
+
+HCubeInitCheckpoint::Key HCubeInitCheckpoint::key(const HCubeInitFlags& flags,
+                                                  const Vector3f& v, float s) {
+	Key k;
+	k.cells = (uint32_t) ::round(flags.sizeKpc / s);
+	k.x = (uint32_t) ::round((v.x - flags.offsetKpc.x) / s);
+	k.y = (uint32_t) ::round((v.y - flags.offsetKpc.y) / s);
+	k.z = (uint32_t) ::round((v.z - flags.offsetKpc.z) / s);
+	return k;
+}
+
+size_t HCubeInitCheckpoint::end(const HCubeInitFlags& flags, const Vector3f& v,
+                                float s) const {
+	map_t::const_iterator i = indices.find(key(flags, v, s));
+
+	if (i != indices.end())
+		return i->second;
+	else
+		return 0;
+}
+
+void HCubeInitCheckpoint::done(const HCubeInitFlags& flags, const Vector3f& v,
+                               float s, size_t end) {
+	const Key k = key(flags, v, s);
+	Record r;
+	r.cells = k.cells;
+	r.x = k.x;
+	r.y = k.y;
+	r.z = k.z;
+	r.end = end;
+	r.reserved = 0;
+	r.updateChecksum();
+
+	#pragma omp critical(HCubeInitCheckpoint)
+	{
+		pending.push_back(r);
+
+		if (pending.size() >= batch || time(0) - synced >= interval)
+			write();
+	}
+}
+
+void HCubeInitCheckpoint::invalidate(const HCubeInitFlags& flags,
+                                     const Vector3f& v, float s) {
+	const Key k = key(flags, v, s);
+	Record r;
+	r.cells = k.cells;
+	r.x = k.x;
+	r.y = k.y;
+	r.z = k.z;
+	r.end = 0;
+	r.reserved = 0;
+	r.updateChecksum();
+
+	#pragma omp critical(HCubeInitCheckpoint)
+	{
+		dropped.push_back(k);
+		pending.push_back(r);
+		write();
+	}
+}
+
+void HCubeInitCheckpoint::drop() {
+	erase(dropped);
+	dropped.clear();
+}
+
+// One pass over indices, each record is looked up at the sizes of the keys.
+void HCubeInitCheckpoint::erase(const std::vector<Key>& keys) {
+	if (keys.empty())
+		return;
+
+	std::unordered_set<Key, KeyHash> set(keys.begin(), keys.end());
+	std::vector<uint32_t> sizes;
+
+	for (size_t i = 0; i < keys.size(); i++)
+		if (std::find(sizes.begin(), sizes.end(), keys[i].cells) == sizes.end())
+			sizes.push_back(keys[i].cells);
+
+	for (map_t::iterator i = indices.begin(); i != indices.end();) {
+		const Key& c = i->first;
+		bool inside = false;
+
+		for (size_t s = 0; s < sizes.size() && !inside; s++) {
+			if (c.cells % sizes[s])
+				continue;
+
+			const uint32_t f = c.cells / sizes[s];
+			const Key k = {sizes[s], c.x / f, c.y / f, c.z / f};
+			inside = set.count(k) > 0;
+		}
+
+		if (inside)
+			i = indices.erase(i);
+		else
+			++i;
+	}
+}
+
+void HCubeInitCheckpoint::flush() {
+	#pragma omp critical(HCubeInitCheckpoint)
+	write();
+}
+
+void HCubeInitCheckpoint::syncBefore(void* data, size_t size) {
+	sync_data = data;
+	sync_size = size;
+}
+
+void HCubeInitCheckpoint::syncBefore(int file) {
+	sync_file = file;
+}
+
+void HCubeInitCheckpoint::write() {
+	if (file == -1 || pending.empty())
+		return;
+
+	// the cubes have to be durable before the records that refer to them
+	if (sync_data && ::msync(sync_data, sync_size, MS_SYNC) == -1)
+		perror("[HCubeInitCheckpoint] msync");
+	if (sync_file != -1 && ::fdatasync(sync_file) == -1)
+		perror("[HCubeInitCheckpoint] fdatasync");
+
+	const char* p = (const char*) pending.data();
+	size_t bytes = pending.size() * sizeof(Record);
+
+	while (bytes) {
+		ssize_t n = ::write(file, p, bytes);
+
+		if (n <= 0) {
+			perror("[HCubeInitCheckpoint]");
+			break;
+		}
+
+		p += n;
+		bytes -= n;
+	}
+
+	::fdatasync(file);
+	pending.clear();
+	synced = time(0);
+}
+
+} // namespace quimby
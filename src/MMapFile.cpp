@@ -13,6 +13,7 @@
 #include <stdio.h>
 #include <stdexcept>
 #include <iostream>
+#include <algorithm>
 
 namespace quimby {
 
@@ -145,4 +146,258 @@ void* MMapFileWrite::data() {
 	return _data;
 }
 
+BufferedFileWrite::BufferedFileWrite(const std::string& filename,
+                                     size_t buffer_size, bool resume) :
+	_file(-1), _buffer_offset(0), _buffer_size(buffer_size), _pending_begin(0),
+	_pending_end(0) {
+	if (resume)
+		_file = ::open(filename.c_str(), O_RDWR | O_CREAT, 0666);
+	else
+		_file = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+
+	if (_file == -1)
+		throw std::runtime_error("[BufferedFileWrite] error opening file: " + filename);
+
+	_buffer.reserve(_buffer_size);
+}
+
+BufferedFileWrite::~BufferedFileWrite() {
+	try {
+		close();
+	} catch (std::exception& e) {
+		std::cerr << e.what() << std::endl;
+	}
+}
+
+void BufferedFileWrite::write(off_t offset, const void* data, size_t size) {
+	if (!_buffer.empty() && (offset != _buffer_offset + (off_t) _buffer.size()
+	                         || _buffer.size() + size > _buffer_size))
+		flush();
+
+	if (_buffer.empty())
+		_buffer_offset = offset;
+
+	if (size > _buffer_size) {
+		const char* p = (const char*) data;
+
+		for (size_t done = 0; done < size; done += _buffer_size) {
+			write(offset + done, p + done, std::min(_buffer_size, size - done));
+			flush();
+		}
+
+		return;
+	}
+
+	_buffer.insert(_buffer.end(), (const char*) data, (const char*) data + size);
+}
+
+void BufferedFileWrite::read(off_t offset, void* data, size_t size) {
+	flush();
+
+	char* p = (char*) data;
+
+	while (size) {
+		ssize_t n = ::pread(_file, p, size, offset);
+
+		if (n <= 0)
+			throw std::runtime_error("[BufferedFileWrite] error reading file!");
+
+		p += n;
+		offset += n;
+		size -= n;
+	}
+}
+
+void BufferedFileWrite::flush() {
+	if (_file == -1 || _buffer.empty())
+		return;
+
+	const char* p = &_buffer[0];
+	size_t size = _buffer.size();
+	off_t offset = _buffer_offset;
+
+	while (size) {
+		ssize_t n = ::pwrite(_file, p, size, offset);
+
+		if (n <= 0)
+			throw std::runtime_error("[BufferedFileWrite] error writing file!");
+
+		p += n;
+		offset += n;
+		size -= n;
+	}
+
+	writeback(_buffer_offset, offset);
+	_buffer.clear();
+}
+
+void BufferedFileWrite::writeback(off_t begin, off_t end) {
+#ifdef SYNC_FILE_RANGE_WRITE
+	// start writing this range, wait for the previous one
+	::sync_file_range(_file, begin, end - begin, SYNC_FILE_RANGE_WRITE);
+
+	if (_pending_end > _pending_begin)
+		::sync_file_range(_file, _pending_begin, _pending_end - _pending_begin,
+		                  SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+		                  | SYNC_FILE_RANGE_WAIT_AFTER);
+#else
+	::fdatasync(_file);
+#endif
+
+	if (_pending_end > _pending_begin)
+		::posix_fadvise(_file, _pending_begin, _pending_end - _pending_begin,
+		                POSIX_FADV_DONTNEED);
+
+	_pending_begin = begin;
+	_pending_end = end;
+}
+
+void BufferedFileWrite::sync() {
+	flush();
+
+	if (_file == -1)
+		return;
+
+	if (::fdatasync(_file) == -1)
+		throw std::runtime_error("[BufferedFileWrite] error syncing file!");
+
+	if (_pending_end > _pending_begin)
+		::posix_fadvise(_file, _pending_begin, _pending_end - _pending_begin,
+		                POSIX_FADV_DONTNEED);
+
+	_pending_begin = _pending_end = 0;
+}
+
+void BufferedFileWrite::truncate(off_t size) {
+	flush();
+
+	if (_file != -1 && ftruncate(_file, size) == -1)
+		throw std::runtime_error("[BufferedFileWrite] error truncating file!");
+}
+
+void BufferedFileWrite::close() {
+	if (_file == -1)
+		return;
+
+	sync();
+	::close(_file);
+	_file = -1;
+}
+
+StreamingFileRead::StreamingFileRead(const std::string& filename) :
+	_file(-1), _size(0) {
+	_file = ::open(filename.c_str(), O_RDONLY);
+
+	if (_file == -1)
+		throw std::runtime_error("[StreamingFileRead] error opening file: " + filename);
+
+	_size = ::lseek(_file, 0, SEEK_END);
+	::posix_fadvise(_file, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+StreamingFileRead::~StreamingFileRead() {
+	close();
+}
+
+off_t StreamingFileRead::size() const {
+	return _size;
+}
+
+void StreamingFileRead::read(off_t offset, void* data, size_t size,
+                             bool backward) {
+	if (backward) {
+		if (offset > 0) {
+			off_t begin = std::max((off_t) 0, offset - (off_t) size);
+			::posix_fadvise(_file, begin, offset - begin, POSIX_FADV_WILLNEED);
+		}
+	} else if (offset + (off_t) size < _size) {
+		::posix_fadvise(_file, offset + size, size, POSIX_FADV_WILLNEED);
+	}
+
+	char* p = (char*) data;
+	off_t o = offset;
+	size_t remaining = size;
+
+	while (remaining) {
+		ssize_t n = ::pread(_file, p, remaining, o);
+
+		if (n <= 0)
+			throw std::runtime_error("[StreamingFileRead] error reading file!");
+
+		p += n;
+		o += n;
+		remaining -= n;
+	}
+
+	::posix_fadvise(_file, offset, size, POSIX_FADV_DONTNEED);
+}
+
+void StreamingFileRead::close() {
+	if (_file == -1)
+		return;
+
+	::close(_file);
+	_file = -1;
+}
+
+static bool copyRange(int input, off_t input_offset, int output,
+                      off_t output_offset, size_t size) {
+	std::vector<char> buffer(std::min(size, (size_t) 16 << 20));
+
+	while (size) {
+		ssize_t n = ::pread(input, &buffer[0], std::min(size, buffer.size()),
+		                    input_offset);
+
+		if (n <= 0)
+			return false;
+
+		for (ssize_t done = 0; done < n;) {
+			ssize_t w = ::pwrite(output, &buffer[done], n - done,
+			                     output_offset + done);
+
+			if (w <= 0)
+				return false;
+
+			done += w;
+		}
+
+		input_offset += n;
+		output_offset += n;
+		size -= n;
+	}
+
+	return true;
+}
+
+bool copyFileRange(const std::string& input, off_t input_offset,
+                   const std::string& output, off_t output_offset, size_t size) {
+	int in = ::open(input.c_str(), O_RDONLY);
+	int out = ::open(output.c_str(), O_WRONLY);
+	bool result = (in != -1 && out != -1);
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+	while (result && size) {
+		ssize_t n = ::copy_file_range(in, &input_offset, out, &output_offset,
+		                              size, 0);
+
+		// not supported for these files, copy the rest in user space
+		if (n <= 0)
+			break;
+
+		size -= n;
+	}
+#endif
+
+	if (result && size)
+		result = copyRange(in, input_offset, out, output_offset, size);
+
+	if (in != -1)
+		::close(in);
+
+	if (out != -1)
+		::close(out);
+
+	return result;
+}
+
 } // namespace quimby
@@ -72,6 +72,21 @@ public:
 		field += value * k;
 	}
 
+	void visitBlock(const SmoothParticle *particles,
+			const KernelPayload *payload, size_t n) {
+		if (!payload) {
+			DatabaseVisitor::visitBlock(particles, payload, n);
+			return;
+		}
+
+		for (size_t i = 0; i < n; i++) {
+			const SmoothParticle &p = particles[i];
+			if (intersects(p.position, p.position, p.smoothingLength))
+				field += payload[i].bfield
+						* p.kernel(position, payload[i].invSmoothingLength);
+		}
+	}
+
 	void end() {
 	}
 
@@ -86,6 +101,11 @@ public:
 		return (x && y && z);
 	}
 
+	bool getBounds(Vector3f &lower, Vector3f &upper) {
+		lower = upper = position;
+		return true;
+	}
+
 	const Vector3f &getField() {
 		return field;
 	}
@@ -136,12 +156,27 @@ public:
 		field->sampleParticle(p);
 	}
 
+	void visitBlock(const SmoothParticle *particles,
+			const KernelPayload *payload, size_t n) {
+		for (size_t i = 0; i < n; i++) {
+			const SmoothParticle &p = particles[i];
+			if (intersects(p.position, p.position, p.smoothingLength))
+				field->sampleParticle(p, payload ? payload + i : 0);
+		}
+	}
+
 	bool intersects(const Vector3f &lower, const Vector3f &upper,
 			float margin) {
 		return box.intersects(lower - Vector3f(margin),
 				upper + Vector3f(margin));
 	}
 
+	bool getBounds(Vector3f &lower, Vector3f &upper) {
+		lower = box.min;
+		upper = box.max;
+		return true;
+	}
+
 	void end() {
 
 	}
@@ -181,12 +216,17 @@ bool SampledMagneticField::restore(const std::string &dumpfilename) {
 	return _grid.restore(dumpfilename);
 }
 
-void SampledMagneticField::sampleParticle(const SmoothParticle &part) {
+void SampledMagneticField::sampleParticle(const SmoothParticle &part,
+		const KernelPayload *payload) {
 	SmoothParticle particle = part;
 	particle.smoothingLength += _broadeningFactor * _grid.getCellLength();
 
-	Vector3f value = particle.bfield * particle.weight() * particle.mass
-			/ particle.rho;
+	// the payload is for the unbroadened particle
+	if (_broadeningFactor != 0)
+		payload = 0;
+
+	Vector3f value = payload ? payload->bfield
+			: particle.bfield * particle.weight() * particle.mass / particle.rho;
 	float r = particle.smoothingLength + _stepsizeKpc;
 
 	Vector3f relativePosition = particle.position - _originKpc;
@@ -207,7 +247,9 @@ void SampledMagneticField::sampleParticle(const SmoothParticle &part) {
 			p.y = y * _stepsizeKpc;
 			for (size_t z = z_min; z <= z_max; z++) {
 				p.z = z * _stepsizeKpc;
-				float k = particle.kernel(_originKpc + p);
+				float k = payload ?
+						particle.kernel(_originKpc + p, payload->invSmoothingLength)
+						: particle.kernel(_originKpc + p);
 				_grid.get(x, y, z) += value * k;
 			}
 		}
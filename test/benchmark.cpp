@@ -8,6 +8,7 @@
 #include <iostream>
 #include <sstream>
 
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <omp.h>
@@ -15,6 +16,7 @@
 #include <quimby/Database.h>
 #include <quimby/Grid.h>
 #include <quimby/HCube.h>
+#include <quimby/HCubeMagneticField.h>
 #include <quimby/tga.h>
 
 using namespace quimby;
@@ -59,6 +61,12 @@ public:
 
 };
 
+size_t page_faults() {
+	struct rusage usage;
+	::getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_minflt + usage.ru_majflt;
+}
+
 float consume(const Vector3f &v) {
 	float b = 1;
 	for (size_t i = 0; i<100; i++) {
@@ -107,6 +115,21 @@ public:
 	}
 };
 
+class FieldAccessor: public Accessor {
+	MagneticField &field;
+public:
+	FieldAccessor(MagneticField &field) :
+			field(field) {
+
+	}
+
+	Vector3f get(const Vector3f &pos) {
+		Vector3f b;
+		field.getField(pos, b);
+		return b;
+	}
+};
+
 class RandomAccessBenchmark {
 	Vector3f origin;
 	float size;
@@ -294,7 +317,37 @@ int main(int argc, const char **argv) {
 	RandomWalkBenchmark rwb(origin, size);
 	Accessor nullaccessor;
 
-//ToDo: zorder
+	// random walk on a fresh on demand mapping, once per file layout
+	stringstream mortonfilename;
+	mortonfilename << "benchmark-" << bins << "-hcube-morton.hc4";
+	if (!check_file(mortonfilename.str())) {
+		cout << "repack hc4" << endl;
+		HCubeFile4::repack(hcubefilename.str(), mortonfilename.str());
+	}
+
+	cout << "layout faults time" << endl;
+	const string layouts[2] = { hcubefilename.str(), mortonfilename.str() };
+	for (size_t l = 0; l < 2; l++) {
+		HCubeFile4 layoutfile(layouts[l], OnDemand);
+		HCubeAccessor<4> layoutaccessor(origin, size, layoutfile.hcube());
+		size_t faults = page_faults();
+		double seconds = rwb.run(layoutaccessor, 1, 10000000);
+		cout << l << " " << (page_faults() - faults) << " " << seconds << endl;
+	}
+
+	// random walk through the field, with and without leaf cache
+	cout << "cache hits misses time" << endl;
+	ref_ptr<HCubeFile4> fieldfile = new HCubeFile4(hcubefilename.str());
+	for (size_t c = 0; c < 2; c++) {
+		HCubeMagneticField4 field(fieldfile, origin, size);
+		field.setCache(c == 1);
+		FieldAccessor fieldaccessor(field);
+		double seconds = rwb.run(fieldaccessor, 1, 10000000);
+		field.flushCacheStatistics();
+		cout << c << " " << field.getCacheHits() << " "
+				<< field.getCacheMisses() << " " << seconds << endl;
+	}
+
 //ToDo: mmap grid
 	cout << "accessor benchmark threads time" << endl;
 	const size_t samples = 10;
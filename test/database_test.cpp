@@ -1,13 +1,105 @@
 #include "quimby/Database.h"
 
+#include <algorithm>
 #include <vector>
 #include <assert.h>
+#include <fstream>
 #include <iostream>
+#include <math.h>
+#include <stdexcept>
+#include <stdlib.h>
+#include <string.h>
 
 using namespace quimby;
 using namespace std;
 
-int main() {
+const float size = 16;
+
+class CountVisitor: public DatabaseVisitor {
+	AABB<float> box;
+	bool bounded;
+public:
+	size_t count;
+
+	CountVisitor(const Vector3f &lower, const Vector3f &upper, bool bounded) :
+			box(lower, upper), bounded(bounded), count(0) {
+	}
+
+	void begin(const Database &) {
+		count = 0;
+	}
+
+	bool intersects(const Vector3f &lower, const Vector3f &upper,
+			float margin) {
+		return box.intersects(lower - Vector3f(margin),
+				upper + Vector3f(margin));
+	}
+
+	bool getBounds(Vector3f &lower, Vector3f &upper) {
+		lower = box.min;
+		upper = box.max;
+		return bounded;
+	}
+
+	DatabaseVisitor *clone() const {
+		return new CountVisitor(box.min, box.max, bounded);
+	}
+
+	void reduce(DatabaseVisitor &clone) {
+		count += ((CountVisitor &) clone).count;
+	}
+
+	void visit(const SmoothParticle &) {
+		count++;
+	}
+
+	void end() {
+	}
+};
+
+// counts the particles of the blocks, without a base class
+struct BlockCountVisitor {
+	size_t count;
+
+	void begin(const Database &) {
+		count = 0;
+	}
+
+	bool getBounds(Vector3f &, Vector3f &) {
+		return false;
+	}
+
+	bool intersects(const Vector3f &, const Vector3f &, float) {
+		return true;
+	}
+
+	void visitBlock(const SmoothParticle *, const KernelPayload *, size_t n) {
+		count += n;
+	}
+
+	void end() {
+	}
+};
+
+struct PositionLess {
+	bool operator()(const SmoothParticle &a, const SmoothParticle &b) const {
+		if (a.position.x != b.position.x)
+			return a.position.x < b.position.x;
+		if (a.position.y != b.position.y)
+			return a.position.y < b.position.y;
+		return a.position.z < b.position.z;
+	}
+};
+
+void sample(const Database &db, std::vector<Vector3f> &grid) {
+	const size_t n = 16;
+	grid.assign(n * n * n, Vector3f(0, 0, 0));
+	SimpleSamplingVisitor v(grid.data(), n, Vector3f(2, 3, 1), 10);
+	v.sample(db);
+}
+
+void test_single() {
+	cout << ">> single" << endl;
 	vector<SmoothParticle> particles(1);
 	particles[0].position = Vector3f(1, 2, 3);
 	particles[0].smoothingLength = 1;
@@ -23,22 +115,222 @@ int main() {
 
 	particles.clear();
 	db.getParticles(Vector3f(0, 0, 0), Vector3f(4, 4, 4), particles);
-	if (particles.size() != 1) {
-		cerr << "Error, not one particle!" << endl;
-	}
+	if (particles.size() != 1)
+		throw runtime_error("not one particle!");
 
 	if (particles[0].position.x != 1)
-		cerr << "Error, wriong x!" << endl;
+		throw runtime_error("wrong x!");
 	if (particles[0].position.y != 2)
-		cerr << "Error, wriong y!" << endl;
+		throw runtime_error("wrong y!");
 	if (particles[0].position.z != 3)
-		cerr << "Error, wriong z!" << endl;
+		throw runtime_error("wrong z!");
 
 	particles.clear();
 	db.getParticles(Vector3f(5, 0, 0), Vector3f(6, 4, 4), particles);
-	if (particles.size() != 0) {
-		cerr << "Error, more particles!" << endl;
+	if (particles.size() != 0)
+		throw runtime_error("more particles!");
+}
+
+void test_bounded_accept(FileDatabase *db) {
+	cout << ">> bounded accept" << endl;
+
+	// only the blocks around the bounds are visited, with the same particles
+	srand48(5);
+	for (size_t i = 0; i < 100; i++) {
+		Vector3f lower(drand48() * 20 - 2, drand48() * 20 - 2, drand48() * 20 - 2);
+		Vector3f upper = lower + Vector3f(drand48(), drand48(), drand48()) * 4;
+		CountVisitor all(lower, upper, false), bounded(lower, upper, true);
+		db->accept(all);
+		db->accept(bounded);
+		if (all.count != bounded.count)
+			throw runtime_error("bounded accept differs!");
+		db->acceptParallel(bounded);
+		if (all.count != bounded.count)
+			throw runtime_error("parallel accept differs!");
 	}
 
+	BlockCountVisitor blocks;
+	db->accept(blocks);
+	if (blocks.count != db->getCount())
+		throw runtime_error("particles missing from the blocks!");
+
+	// sampling in slabs writes the same grid
+	const size_t n = 16;
+	vector<Vector3f> serial(n * n * n), slabs;
+	SimpleSamplingVisitor s(serial.data(), n, Vector3f(2, 3, 1), 10);
+	db->accept(s);
+	slabs.resize(serial.size());
+	SimpleSamplingVisitor p(slabs.data(), n, Vector3f(2, 3, 1), 10);
+	p.sample(*db);
+	if (memcmp(serial.data(), slabs.data(), serial.size() * sizeof(Vector3f)))
+		throw runtime_error("sampling in slabs differs!");
+	if (s.getCount() == 0 || p.getCount() != s.getCount())
+		throw runtime_error("sampling in slabs counts differently!");
+}
+
+void test_parallel_visitors(FileDatabase *db) {
+	cout << ">> parallel visitors" << endl;
+
+	// clones of the library visitors, reduced in thread order
+	vector<SmoothParticle> serial, parallel;
+	Vector3f lower(3, 2, 1), upper(9, 12, 5);
+	db->getParticles(lower, upper, serial);
+	if (db->getParticles(lower, upper, parallel, true) != serial.size()
+			|| parallel.size() != serial.size())
+		throw runtime_error("parallel collect differs!");
+	sort(serial.begin(), serial.end(), PositionLess());
+	sort(parallel.begin(), parallel.end(), PositionLess());
+	if (memcmp(serial.data(), parallel.data(),
+			serial.size() * sizeof(SmoothParticle)))
+		throw runtime_error("parallel collect differs!");
+
+	const size_t n = 16;
+	vector<Vector3f> expected(n * n * n), grid(n * n * n);
+	SimpleSamplingVisitor s(expected.data(), n, Vector3f(2, 3, 1), 10);
+	SimpleSamplingVisitor p(grid.data(), n, Vector3f(2, 3, 1), 10);
+	s.limit(2, 13, 0, 15, 1, 15);
+	p.limit(2, 13, 0, 15, 1, 15);
+	db->accept(s);
+	db->acceptParallel(p);
+	if (s.getCount() != p.getCount())
+		throw runtime_error("parallel sampling count differs!");
+	for (size_t i = 0; i < grid.size(); i++) {
+		if ((grid[i] - expected[i]).length() > 1e-5 * (1 + expected[i].length()))
+			throw runtime_error("parallel sampling differs!");
+	}
+}
+
+void test_soa(FileDatabase *db) {
+	cout << ">> soa" << endl;
+	FileDatabase::createSoA("database_test_particles.db", "database_test_soa.db");
+	ref_ptr<FileDatabase> soa = new FileDatabase("database_test_soa.db");
+	if (!soa->isSoA() || soa->getCount() != db->getCount()
+			|| soa->getMargin() != db->getMargin())
+		throw runtime_error("unexpected version 2 database!");
+
+	srand48(6);
+	for (size_t i = 0; i < 100; i++) {
+		Vector3f lower(drand48() * 20 - 2, drand48() * 20 - 2, drand48() * 20 - 2);
+		Vector3f upper = lower + Vector3f(drand48(), drand48(), drand48()) * 4;
+		CountVisitor v1(lower, upper, i % 2), v2(lower, upper, i % 2);
+		db->accept(v1);
+		soa->accept(v2);
+		if (v1.count != v2.count)
+			throw runtime_error("version 2 database differs!");
+	}
+
+	vector<Vector3f> expected, grid;
+	sample(*db, expected);
+	sample(*soa, grid);
+	if (memcmp(expected.data(), grid.data(), grid.size() * sizeof(Vector3f)))
+		throw runtime_error("sampling version 2 database differs!");
+}
+
+void test_payload(FileDatabase *db) {
+	cout << ">> payload" << endl;
+	FileDatabase::createSoA("database_test_particles.db",
+			"database_test_payload.db", true);
+	ref_ptr<FileDatabase> payload = new FileDatabase("database_test_payload.db");
+	if (!payload->hasPayload() || payload->getCount() != db->getCount())
+		throw runtime_error("unexpected version 3 database!");
+
+	// the precomputed inverse smoothing length differs in the last bits
+	vector<Vector3f> expected, grid;
+	sample(*db, expected);
+	sample(*payload, grid);
+	for (size_t i = 0; i < grid.size(); i++) {
+		if ((grid[i] - expected[i]).length() > 1e-5 * (1 + expected[i].length()))
+			throw runtime_error("sampling version 3 database differs!");
+	}
+}
+
+// counts the blocks and particles handed over as blocks
+class BlockVisitor: public DatabaseVisitor {
+public:
+	size_t blocks, particles, payloads;
+
+	void begin(const Database &) {
+		blocks = particles = payloads = 0;
+	}
+
+	bool intersects(const Vector3f &, const Vector3f &, float) {
+		return true;
+	}
+
+	void visit(const SmoothParticle &) {
+		throw runtime_error("particle visited outside of a block!");
+	}
+
+	void visitBlock(const SmoothParticle *, const KernelPayload *payload,
+			size_t n) {
+		blocks++;
+		particles += n;
+		if (payload)
+			payloads += n;
+	}
+
+	void end() {
+	}
+};
+
+void test_databases() {
+	cout << ">> databases" << endl;
+	Databases dbs;
+	dbs.add(new FileDatabase("database_test_particles.db"));
+	dbs.add(new FileDatabase("database_test_soa.db"));
+	dbs.add(new FileDatabase("database_test_payload.db"));
+
+	// blocks and the payload of version 3 reach the visitor through the adapter
+	BlockVisitor v;
+	dbs.accept(v);
+	if (v.blocks == 0 || v.particles != dbs.getCount())
+		throw runtime_error("blocks lost in Databases!");
+	if (v.payloads != dbs.getCount() / 3)
+		throw runtime_error("payload lost in Databases!");
+
+	// sampling through the adapter uses the payload as well
+	Databases wrapped;
+	ref_ptr<FileDatabase> payload = new FileDatabase("database_test_payload.db");
+	wrapped.add(payload);
+	vector<Vector3f> expected, grid;
+	sample(*payload, expected);
+	sample(wrapped, grid);
+	if (memcmp(expected.data(), grid.data(), grid.size() * sizeof(Vector3f)))
+		throw runtime_error("sampling through Databases differs!");
+}
+
+int main() {
+	test_single();
+
+	vector<SmoothParticle> particles(500);
+	srand48(1);
+	for (size_t i = 0; i < particles.size(); i++) {
+		SmoothParticle &p = particles[i];
+		p.position = Vector3f(drand48(), drand48(), drand48() * 0.5) * size;
+		p.bfield = Vector3f(drand48(), drand48(), drand48());
+		p.smoothingLength = 1 + drand48();
+		p.mass = 1;
+		p.rho = 1;
+	}
+	FileDatabase::create(particles, "database_test_particles.db", 4);
+	ref_ptr<FileDatabase> db = new FileDatabase("database_test_particles.db");
+	if (db->getCount() != particles.size())
+		throw runtime_error("unexpected number of particles!");
+
+	test_bounded_accept(db);
+	test_parallel_visitors(db);
+	test_soa(db);
+	test_payload(db);
+
+	// the later versions directly, without the temporary version 1 file
+	FileDatabase::create(particles, "database_test_v2.db", 4, false, 2);
+	ref_ptr<FileDatabase> v2 = new FileDatabase("database_test_v2.db");
+	if (!v2->isSoA() || v2->hasPayload() || v2->getCount() != particles.size()
+			|| ifstream("database_test_v2.db.v1"))
+		throw runtime_error("unexpected version 2 database!");
+
+	test_databases();
+
+	cout << "done" << endl;
 	return 0;
 }
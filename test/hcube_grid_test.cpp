@@ -0,0 +1,982 @@
+#include "quimby/HCube.h"
+#include "quimby/HCubeMagneticField.h"
+
+#include <fstream>
+#include <iostream>
+#include <math.h>
+#include <sstream>
+#include <stdexcept>
+#include <stdlib.h>
+
+using namespace quimby;
+
+const size_t bins = 16;
+const float size = 16;
+
+void test_vector(const Vector3f &value, const Vector3f &expected) {
+	if (!(value == expected)) {
+		std::cerr << value << " != " << expected << std::endl;
+		throw std::runtime_error("unexpected value!");
+	}
+}
+
+void create_grid(Grid<Vector3f> &grid) {
+	grid.create(bins, size);
+	for (size_t x = 0; x < bins; x++) {
+		for (size_t y = 0; y < bins; y++) {
+			for (size_t z = 0; z < bins; z++) {
+				// uniform lower half, structured upper half
+				if (x < bins / 2)
+					grid.get(x, y, z) = Vector3f(1, 2, 3);
+				else
+					grid.get(x, y, z) = Vector3f(x, y * 0.5, z * z + 1);
+			}
+		}
+	}
+}
+
+void test_getValues(const HCube4 *hcube) {
+	std::cout << ">> getValues" << std::endl;
+	const size_t n = 1000;
+	std::vector<float> x(n), y(n), z(n);
+	srand48(0);
+	for (size_t i = 0; i < n; i++) {
+		x[i] = drand48() * size;
+		y[i] = drand48() * size;
+		z[i] = drand48() * size;
+	}
+
+	// outside positions
+	x[10] = -0.1;
+	y[20] = size;
+	z[30] = 2 * size;
+
+	std::vector<Vector3f> values(n);
+	if (hcube->getValues(x.data(), y.data(), z.data(), values.data(), n, size))
+		throw std::runtime_error("invalid positions not reported!");
+
+	for (size_t i = 0; i < n; i++) {
+		if (i == 10 || i == 20 || i == 30) {
+			test_vector(values[i], Vector3f(0, 0, 0));
+			continue;
+		}
+		const Vector3f &v = hcube->getValue(Vector3f(x[i], y[i], z[i]), size);
+		test_vector(values[i], v);
+	}
+}
+
+void test_lookup(ref_ptr<HCubeFile4> file) {
+	std::cout << ">> lookup" << std::endl;
+	const HCube4 *hcube = file->hcube();
+
+	// cell centers of the source grid
+	for (size_t i = 0; i < bins; i++) {
+		Vector3f p(i + 0.5, (i * 7) % bins + 0.5, (i * 3) % bins + 0.5);
+		Vector3f v;
+		if (hcube->getValue(p, size, v) != HCubeValid)
+			throw std::runtime_error("valid position not found!");
+		test_vector(v, hcube->getValue(p, size));
+	}
+
+	Vector3f v(1, 1, 1);
+	if (hcube->getValue(Vector3f(size, 0, 0), size, v) != HCubeInvalidPosition)
+		throw std::runtime_error("invalid position not reported!");
+	test_vector(v, Vector3f(0, 0, 0));
+
+	HCubeMagneticField4 field(file, Vector3f(10, 10, 10), size);
+	if (!field.getField(Vector3f(20, 20, 20), v))
+		throw std::runtime_error("valid position not found!");
+	if (field.getField(Vector3f(9, 20, 20), v))
+		throw std::runtime_error("invalid position not reported!");
+}
+
+void test_header(ref_ptr<HCubeFile4> file) {
+	std::cout << ">> header" << std::endl;
+	if (!file->hasHeader())
+		throw std::runtime_error("header not found!");
+	const HCubeHeader &header = file->header();
+	if (header.n != 4 || header.depth != 1 || header.size != size
+			|| header.cubes != file->hcube()->getCubeCount())
+		throw std::runtime_error("unexpected header!");
+	test_vector(header.origin, Vector3f(0, 0, 0));
+
+	ref_ptr<MagneticField> field = openHCubeMagneticField("hcube_grid_test.hc4");
+	Vector3f p(12.5, 3.5, 7.5), v;
+	if (!field->getField(p, v))
+		throw std::runtime_error("valid position not found!");
+	test_vector(v, file->hcube()->getValue(p, size));
+
+	// files without header start with the root cube
+	{
+		std::ofstream legacy("hcube_grid_test_legacy.hc4", std::ios::binary);
+		legacy.write((const char *) file->hcube(),
+				file->getCubeCount() * sizeof(HCube4));
+	}
+	HCubeFile4 legacy("hcube_grid_test_legacy.hc4");
+	if (legacy.hasHeader() || legacy.getCubeCount() != header.cubes)
+		throw std::runtime_error("legacy file not detected!");
+	test_vector(legacy.hcube()->getValue(p, size), v);
+
+	bool thrown = false;
+	try {
+		HCubeFile8 wrong("hcube_grid_test.hc4");
+	} catch (std::runtime_error &e) {
+		thrown = true;
+	}
+	if (!thrown)
+		throw std::runtime_error("wrong N not detected!");
+}
+
+void test_close(float value, float expected) {
+	if (fabs(value - expected) > 1e-4) {
+		std::cerr << value << " != " << expected << std::endl;
+		throw std::runtime_error("unexpected value!");
+	}
+}
+
+void test_interpolate(ref_ptr<HCubeFile4> file) {
+	std::cout << ">> interpolate" << std::endl;
+	const HCube4 *hcube = file->hcube();
+	Vector3f v;
+
+	// linear inside the structured half, cell values are at the centers
+	srand48(2);
+	for (size_t i = 0; i < 100; i++) {
+		Vector3f p(8.5 + drand48() * 7, 0.5 + drand48() * 15,
+				drand48() * size);
+		if (hcube->interpolate(p, size, v) != HCubeValid)
+			throw std::runtime_error("valid position not found!");
+		test_close(v.x, p.x - 0.5);
+		test_close(v.y, (p.y - 0.5) * 0.5);
+	}
+
+	// constant inside the collapsed half
+	hcube->interpolate(Vector3f(3, 5, 9), size, v);
+	test_vector(v, Vector3f(1, 2, 3));
+
+	// blend of a collapsed cell and the center of its finer neighbour
+	hcube->interpolate(Vector3f(7.9, 6, 6), size, v);
+	test_close(v.x, 0.525 * 1 + 0.475 * 10);
+
+	if (hcube->interpolate(Vector3f(0, -1, 0), size, v) != HCubeInvalidPosition)
+		throw std::runtime_error("invalid position not reported!");
+
+	HCubeMagneticField4 field(file);
+	field.setInterpolate(true);
+	Vector3f p(10.2, 3.3, 4.4), b;
+	field.getField(p, b);
+	hcube->interpolate(p, size, v);
+	test_vector(b, v);
+}
+
+void test_jacobian(ref_ptr<HCubeFile4> file) {
+	std::cout << ">> jacobian" << std::endl;
+	const HCube4 *hcube = file->hcube();
+	HCubeJacobian j;
+
+	// B = (x, y / 2, z^2 + 1) at the cell centers of the structured half
+	if (hcube->jacobian(Vector3f(10.5, 5.5, 6.5), size, j) != HCubeValid)
+		throw std::runtime_error("valid position not found!");
+	test_vector(j.value, Vector3f(10, 2.5, 37));
+	test_vector(j.dx, Vector3f(1, 0, 0));
+	test_vector(j.dy, Vector3f(0, 0.5, 0));
+	test_vector(j.dz, Vector3f(0, 0, 12));
+	test_close(j.divergence(), 13.5);
+	test_vector(j.curl(), Vector3f(0, 0, 0));
+	test_close(j.magnitudeGradient().z, 37 * 12 / j.value.length());
+
+	// one sided at the border, constant in the collapsed half
+	hcube->jacobian(Vector3f(12.5, 0.5, 15.5), size, j);
+	test_vector(j.dy, Vector3f(0, 0.5, 0));
+	test_vector(j.dz, Vector3f(0, 0, 29));
+	hcube->jacobian(Vector3f(3, 5, 9), size, j);
+	test_close(j.divergence(), 0);
+
+	std::vector<Vector3f> positions(100);
+	std::vector<HCubeJacobian> batch(positions.size());
+	srand48(4);
+	for (size_t i = 0; i < positions.size(); i++)
+		positions[i] = Vector3f(drand48() * size, drand48() * size,
+				drand48() * size);
+	positions[7] = Vector3f(size, 0, 0);
+	if (hcube->jacobians(positions.data(), positions.size(), size,
+			batch.data()))
+		throw std::runtime_error("invalid position not reported!");
+	for (size_t i = 0; i < positions.size(); i++) {
+		hcube->jacobian(positions[i], size, j);
+		test_vector(batch[i].dx, j.dx);
+		test_vector(batch[i].dy, j.dy);
+		test_vector(batch[i].dz, j.dz);
+	}
+
+	HCubeMagneticField4 field(file);
+	field.getJacobian(Vector3f(10.5, 5.5, 6.5), j);
+	test_close(j.divergence(), 13.5);
+}
+
+void test_same_values(const HCube4 *a, const HCube4 *b) {
+	srand48(3);
+	for (size_t i = 0; i < 1000; i++) {
+		Vector3f p(drand48() * size, drand48() * size, drand48() * size);
+		test_vector(a->getValue(p, size), b->getValue(p, size));
+	}
+}
+
+void test_repack(const std::vector<HCube4> &cubes) {
+	std::vector<HCube4> repacked(cubes.size());
+	HCube4::repack(cubes.data(), cubes.size(), repacked.data());
+	if (repacked[0].getCubeCount() != cubes.size())
+		throw std::runtime_error("unexpected number of cubes!");
+	test_same_values(cubes.data(), repacked.data());
+
+	// level by level: the children of each cube follow those of the previous
+	size_t next = 1;
+	for (size_t i = 0; i < repacked.size(); i++) {
+		size_t count = 0, first = repacked.size(), last = 0;
+		for (size_t x = 0; x < 4; x++)
+			for (size_t y = 0; y < 4; y++)
+				for (size_t z = 0; z < 4; z++) {
+					const Vector3f &e = repacked[i].at(x, y, z);
+					if (!HCube4::isCube(e))
+						continue;
+					size_t child = i + HCube4::toOffset(e);
+					first = std::min(first, child);
+					last = std::max(last, child);
+					count++;
+				}
+		if (count && (first != next || last != next + count - 1))
+			throw std::runtime_error("children not in level order!");
+		next += count;
+	}
+}
+
+void test_dedup() {
+	std::cout << ">> dedup" << std::endl;
+
+	// periodic field, all cubes of the first level are equal
+	Grid<Vector3f> grid;
+	grid.create(bins, size);
+	for (size_t x = 0; x < bins; x++)
+		for (size_t y = 0; y < bins; y++)
+			for (size_t z = 0; z < bins; z++)
+				grid.get(x, y, z) = Vector3f(x % 4, y % 4, z % 4 + 1);
+	HCubeFile4::create(grid, Vector3f(0, 0, 0), size, 0.01, 1e-10, 1,
+			"hcube_grid_test_periodic.hc4");
+	HCubeFile4::deduplicate("hcube_grid_test_periodic.hc4",
+			"hcube_grid_test_dedup.hc4");
+	HCubeFile4::repack("hcube_grid_test_dedup.hc4",
+			"hcube_grid_test_dedup_morton.hc4");
+
+	HCubeFile4 periodic("hcube_grid_test_periodic.hc4");
+	HCubeFile4 dedup("hcube_grid_test_dedup.hc4");
+	HCubeFile4 morton("hcube_grid_test_dedup_morton.hc4");
+	if (periodic.getCubeCount() != 65 || dedup.getCubeCount() != 2
+			|| morton.getCubeCount() != 2
+			|| !(morton.header().flags & HCubeShared))
+		throw std::runtime_error("unexpected number of cubes!");
+	test_same_values(periodic.hcube(), dedup.hcube());
+	test_same_values(periodic.hcube(), morton.hcube());
+
+	// cube 2 is referenced from the root and from cube 1
+	std::vector<HCube4> dag(3), repacked(3);
+	for (size_t c = 0; c < 3; c++)
+		for (size_t x = 0; x < 4; x++)
+			for (size_t y = 0; y < 4; y++)
+				for (size_t z = 0; z < 4; z++)
+					dag[c].at(x, y, z) = Vector3f(c, x, y + z);
+	dag[0].setCube(3, 3, 3, 1);
+	dag[0].setCube(0, 0, 0, 2);
+	dag[1].setCube(1, 2, 3, 1);
+	if (HCube4::repack(dag.data(), 3, repacked.data()) != 3)
+		throw std::runtime_error("unexpected number of cubes!");
+	test_same_values(dag.data(), repacked.data());
+	if (HCube4::toOffset(repacked[0].at(0, 0, 0)) != 2
+			|| HCube4::toOffset(repacked[0].at(3, 3, 3)) != 1)
+		throw std::runtime_error("shared cube not placed after its parents!");
+}
+
+void test_half() {
+	std::cout << ">> half" << std::endl;
+	const float exact[] = { 0, 1, -2, 0.5, 65504, 6.103515625e-05,
+			5.9604644775390625e-08 };
+	for (size_t i = 0; i < sizeof(exact) / sizeof(float); i++)
+		test_close(halfToFloat(floatToHalf(exact[i])), exact[i]);
+	if (floatToHalf(1 + 1. / 4096) != floatToHalf(1))
+		throw std::runtime_error("unexpected rounding!");
+
+	HCubeHalfFile4::create("hcube_grid_test.hc4", "hcube_grid_test_half.hc4");
+	HCubeFile4 file("hcube_grid_test.hc4");
+	ref_ptr<HCubeHalfFile4> half = new HCubeHalfFile4("hcube_grid_test_half.hc4");
+	if (half->getCubeCount() != file.getCubeCount()
+			|| half->header().encoding != HCubeHalfFloat)
+		throw std::runtime_error("unexpected header!");
+
+	// within the error of the input, as checked by the conversion
+	const float error = file.header().error;
+	srand48(4);
+	for (size_t i = 0; i < 1000; i++) {
+		Vector3f p(drand48() * size, drand48() * size, drand48() * size);
+		Vector3f a = file.hcube()->getValue(p, size);
+		Vector3f b = half->hcube()->getValue(p, size);
+		if ((a - b).length() > error * a.length())
+			throw std::runtime_error("half precision error too large!");
+	}
+
+	// small elements next to large ones in a cube lose their precision
+	Grid<Vector3f> range;
+	create_grid(range);
+	range.get(bins - 1, bins - 1, bins - 1) = Vector3f(1e-3, 0, 0);
+	range.get(bins - 2, bins - 1, bins - 1) = Vector3f(1e4, 0, 0);
+	HCubeFile4::create(range, Vector3f(0, 0, 0), size, 0.01, 1e-10, 1,
+			"hcube_grid_test_range.hc4");
+	std::remove("hcube_grid_test_half_range.hc4");
+	bool refused = false;
+	try {
+		HCubeHalfFile4::create("hcube_grid_test_range.hc4",
+				"hcube_grid_test_half_range.hc4");
+	} catch (std::runtime_error &e) {
+		refused = true;
+	}
+	if (!refused || std::ifstream("hcube_grid_test_half_range.hc4"))
+		throw std::runtime_error("half precision beyond the error accepted!");
+	HCubeHalfFile4::create("hcube_grid_test_range.hc4",
+			"hcube_grid_test_half_range.hc4", false);
+	HCubeHalfFile4 loose("hcube_grid_test_half_range.hc4");
+
+	ref_ptr<MagneticField> field = openHCubeMagneticField(
+			"hcube_grid_test_half.hc4");
+	Vector3f p(12.5, 3.5, 7.5), v;
+	field->getField(p, v);
+	test_vector(v, half->hcube()->getValue(p, size));
+
+	bool thrown = false;
+	try {
+		HCubeFile4 wrong("hcube_grid_test_half.hc4");
+	} catch (std::runtime_error &e) {
+		thrown = true;
+	}
+	if (!thrown)
+		throw std::runtime_error("wrong encoding not detected!");
+
+	// a nan leaf would read as a child reference
+	{
+		std::ifstream in("hcube_grid_test.hc4", std::ios::binary);
+		std::ofstream out("hcube_grid_test_nan.hc4", std::ios::binary);
+		out << in.rdbuf();
+	}
+	size_t leaf = 0;
+	while (HCube4::isCube(file.hcube()->at(leaf / 16, leaf / 4 % 4, leaf % 4)))
+		leaf++;
+	{
+		std::fstream out("hcube_grid_test_nan.hc4",
+				std::ios::binary | std::ios::in | std::ios::out);
+		const float nan = NAN;
+		out.seekp(HCubeHeader::dataOffset + leaf * sizeof(Vector3f) + sizeof(float));
+		out.write((const char *) &nan, sizeof(float));
+	}
+	thrown = false;
+	try {
+		HCubeHalfFile4::create("hcube_grid_test_nan.hc4",
+				"hcube_grid_test_half_nan.hc4");
+	} catch (std::runtime_error &e) {
+		thrown = true;
+	}
+	if (!thrown || std::ifstream("hcube_grid_test_half_nan.hc4"))
+		throw std::runtime_error("nan element accepted!");
+}
+
+void test_means() {
+	std::cout << ">> means" << std::endl;
+	{
+		std::ifstream in("hcube_grid_test.hc4", std::ios::binary);
+		std::ofstream out("hcube_grid_test_means.hc4", std::ios::binary);
+		out << in.rdbuf();
+	}
+	HCubeFile4::appendMeans("hcube_grid_test_means.hc4");
+	ref_ptr<HCubeFile4> file = new HCubeFile4("hcube_grid_test_means.hc4");
+	const HCube4 *hcube = file->hcube();
+	const Vector3f *means = file->means();
+	if (!means)
+		throw std::runtime_error("means not found!");
+
+	// first level cube covering [8, 12) x [0, 4) x [0, 4)
+	Vector3f v;
+	hcube->getValue(Vector3f(9, 1, 2), size, 0, means, v);
+	test_vector(v, Vector3f(9.5, 0.75, 4.5));
+	hcube->getValue(Vector3f(1, 1, 2), size, 0, means, v);
+	test_vector(v, Vector3f(1, 2, 3));
+	hcube->getValue(Vector3f(9, 1, 2), size, 1, means, v);
+	test_vector(v, hcube->getValue(Vector3f(9, 1, 2), size));
+
+	HCubeMagneticField4 field(file);
+	field.setMaxDepth(0);
+	field.getField(Vector3f(9, 1, 2), v);
+	test_vector(v, Vector3f(9.5, 0.75, 4.5));
+}
+
+void test_cache(ref_ptr<HCubeFile4> file) {
+	std::cout << ">> cache" << std::endl;
+	const HCube4 *hcube = file->hcube();
+	HCubeMagneticField4 a(file, Vector3f(0, 0, 0), size);
+	HCubeMagneticField4 b(file, Vector3f(1, 0, 0), size);
+
+	// small steps, alternating between the fields now and then
+	srand48(5);
+	Vector3f p(8, 8, 8), v;
+	const size_t steps = 1000;
+	size_t calls = 0;
+	for (size_t i = 0; i < steps; i++) {
+		p += Vector3f(drand48() - 0.5, drand48() - 0.5, drand48() - 0.5) * 0.1;
+		if (i % 100 == 50) {
+			b.getField(p + Vector3f(1, 0, 0), v);
+			test_vector(v, hcube->getValue(p, size));
+		}
+		if (!a.getField(p, v))
+			throw std::runtime_error("valid position not found!");
+		test_vector(v, hcube->getValue(p, size));
+		calls++;
+	}
+
+	a.flushCacheStatistics();
+	if (a.getCacheHits() == 0
+			|| a.getCacheHits() + a.getCacheMisses() != calls)
+		throw std::runtime_error("unexpected cache statistics!");
+
+	if (a.getField(Vector3f(-1, 0, 0), v))
+		throw std::runtime_error("invalid position not reported!");
+
+	// up and down across the cell faces in ulps, with a size that does not
+	// scale exactly
+	const float fieldSize = 7.3;
+	HCubeMagneticField4 c(file, Vector3f(0, 0, 0), fieldSize);
+	for (size_t i = 1; i < bins; i++) {
+		Vector3f q(fieldSize / bins * i, drand48() * fieldSize, drand48() * fieldSize);
+		for (size_t j = 0; j < 4; j++)
+			q.x = nextafterf(q.x, 0);
+		for (size_t j = 0; j < 16; j++) {
+			q.x = (j < 8) ? nextafterf(q.x, fieldSize) : nextafterf(q.x, 0);
+			c.getField(q, v);
+			test_vector(v, hcube->getValue(q, fieldSize));
+		}
+	}
+}
+
+void test_integrate(ref_ptr<HCubeFile4> file) {
+	std::cout << ">> integrate" << std::endl;
+	const HCube4 *hcube = file->hcube();
+	Vector3f integral;
+	float length;
+
+	// inside the uniform half
+	hcube->integrate(Vector3f(0.5, 1, 1), Vector3f(2, 0, 0), 5, size, integral,
+			length);
+	test_close(length, 5);
+	test_vector(integral, Vector3f(5, 10, 15));
+
+	// through the whole cube in both directions
+	hcube->integrate(Vector3f(-10, 1.5, 2.5), Vector3f(1, 0, 0), 100, size,
+			integral, length);
+	test_close(length, 16);
+	test_close(integral.x, 8 + 92);
+	hcube->integrate(Vector3f(30, 1.5, 2.5), Vector3f(-1, 0, 0), 100, size,
+			integral, length);
+	test_close(length, 16);
+	test_close(integral.x, 8 + 92);
+
+	// starting on cell faces, cells are taken in direction of the ray
+	hcube->integrate(Vector3f(16, 4, 4), Vector3f(-1, 0, 0), 4, size,
+			integral, length);
+	test_close(integral.x, 15 + 14 + 13 + 12);
+	test_close(integral.y, 4 * 2);
+	hcube->integrate(Vector3f(12, 16, 4), Vector3f(0, -1, 0), 16, size,
+			integral, length);
+	test_close(integral.x, 12 * 16);
+
+	// oblique rays against fine steps
+	srand48(6);
+	std::vector<Vector3f> start(20), direction(20), integrals(20);
+	std::vector<float> lengths(20, 30), paths(20);
+	for (size_t i = 0; i < start.size(); i++) {
+		start[i] = Vector3f(drand48(), drand48(), drand48()) * size;
+		direction[i] = Vector3f(drand48() - 0.5, drand48() - 0.5,
+				drand48() - 0.5);
+	}
+	if (!hcube->integrate(start.data(), direction.data(), lengths.data(),
+			start.size(), size, integrals.data(), paths.data()))
+		throw std::runtime_error("ray missed!");
+	for (size_t i = 0; i < start.size(); i++) {
+		Vector3f d = direction[i] / direction[i].length();
+		Vector3d sum(0, 0, 0);
+		const double step = 1e-4;
+		size_t steps = 0;
+		for (double t = step / 2; t < lengths[i]; t += step) {
+			Vector3f p = start[i] + d * t;
+			Vector3f v;
+			if (hcube->getValue(p, size, v) != HCubeValid)
+				break;
+			sum += Vector3d(v.x, v.y, v.z) * step;
+			steps++;
+		}
+		if (fabs(paths[i] - steps * step) > 2 * step
+				|| (Vector3d(integrals[i].x, integrals[i].y, integrals[i].z)
+						- sum).length() > 1e-2 * (1 + sum.length()))
+			throw std::runtime_error("unexpected ray integral!");
+	}
+
+	if (hcube->integrate(Vector3f(-1, -1, -1), Vector3f(-1, 0, 0), 10, size,
+			integral, length) != HCubeInvalidPosition)
+		throw std::runtime_error("missing ray not reported!");
+
+	HCubeMagneticField4 field(file, Vector3f(10, 0, 0), size);
+	field.integrate(Vector3f(0, 1.5, 2.5), Vector3f(1, 0, 0), 100, integral,
+			length);
+	test_close(integral.x, 8 + 92);
+}
+
+void test_recompress(ref_ptr<HCubeFile4> file) {
+	std::cout << ">> recompress" << std::endl;
+	HCubeFile4::recompress("hcube_grid_test.hc4",
+			"hcube_grid_test_same.hc4", 0.01, 1e-10);
+	HCubeFile4 same("hcube_grid_test_same.hc4");
+	if (same.getCubeCount() != file->getCubeCount())
+		throw std::runtime_error("unexpected number of cubes!");
+	test_same_values(file->hcube(), same.hcube());
+
+	// everything collapses into the root
+	HCubeFile4::recompress("hcube_grid_test.hc4",
+			"hcube_grid_test_loose.hc4", 100, 1e-10);
+	HCubeFile4 loose("hcube_grid_test_loose.hc4");
+	if (loose.getCubeCount() != 1 || loose.header().error != 100)
+		throw std::runtime_error("unexpected number of cubes!");
+	Vector3f v;
+	loose.hcube()->getValue(Vector3f(9, 1, 2), size, v);
+	test_vector(v, Vector3f(9.5, 0.75, 4.5));
+}
+
+void test_extract(const HCube4 *hcube) {
+	std::cout << ">> extract" << std::endl;
+	const Vector3f origin(2, 4, 6);
+	const float regionSize = 8;
+	const size_t resolutions[] = {4, 32};
+
+	for (size_t r = 0; r < 2; r++) {
+		Grid<Vector3f> grid(resolutions[r], 1);
+		if (hcube->extract(grid, origin, regionSize, size) != HCubeValid)
+			throw std::runtime_error("extract failed!");
+		if (grid.getSize() != regionSize)
+			throw std::runtime_error("unexpected extracted grid size!");
+
+		for (size_t x = 0; x < grid.getBins(); x++)
+			for (size_t y = 0; y < grid.getBins(); y++)
+				for (size_t z = 0; z < grid.getBins(); z++) {
+					Vector3f p = origin + Vector3f(grid.toCellCenter(x),
+							grid.toCellCenter(y), grid.toCellCenter(z));
+					test_vector(grid.get(x, y, z), hcube->getValue(p, size));
+				}
+	}
+
+	Grid<Vector3f> grid(4, 1);
+	if (hcube->extract(grid, Vector3f(10, 0, 0), regionSize, size) == HCubeValid)
+		throw std::runtime_error("region outside accepted!");
+}
+
+void test_slab_build(const Grid<Vector3f> &grid, ref_ptr<HCubeFile4> file) {
+	std::cout << ">> slab build" << std::endl;
+
+	std::ofstream raw("hcube_grid_test.raw", std::ios::binary);
+	raw.write((const char *) grid.elements.data(),
+			grid.elements.size() * sizeof(Vector3f));
+	raw.close();
+
+	HCubeFile4::createFromRaw("hcube_grid_test.raw", bins, Vector3f(0, 0, 0),
+			size, 0.01, 1e-10, 1, "hcube_grid_test_slabs.hc4", false);
+	HCubeFile4 slabs("hcube_grid_test_slabs.hc4");
+	if (slabs.header().layout != HCubeSlabsReversed
+			|| slabs.getCubeCount() != file->getCubeCount()
+			|| slabs.hcube()->getCubeCount() != file->getCubeCount())
+		throw std::runtime_error("unexpected slab build header!");
+	test_same_values(file->hcube(), slabs.hcube());
+
+	// reversed in chunks of 3 cubes
+	HCubeRawSlabReader<Vector3f> reader("hcube_grid_test.raw", bins);
+	HCubeFile4::createFromSlabs(reader, Vector3f(0, 0, 0), size, 0.01, 1e-10,
+			1, 1, "hcube_grid_test_slabs.hc4", 6 * sizeof(HCube4), false);
+	HCubeFile4 chunked("hcube_grid_test_slabs.hc4");
+	test_same_values(file->hcube(), chunked.hcube());
+
+	// the field as a region of a larger raw file, behind the first bins planes
+	std::ofstream larger("hcube_grid_test.raw", std::ios::binary);
+	std::vector<Vector3f> row(2 * bins, Vector3f(1, 2, 3));
+	for (size_t x = 0; x < 2 * bins; x++)
+		for (size_t y = 0; y < 2 * bins; y++) {
+			if (x >= bins && y >= 1 && y < bins + 1)
+				for (size_t z = 0; z < bins; z++)
+					row[z + 2] = grid.get(x - bins, y - 1, z);
+			larger.write((const char *) row.data(), row.size() * sizeof(Vector3f));
+			std::fill(row.begin(), row.end(), Vector3f(1, 2, 3));
+		}
+	larger.close();
+
+	const float step = size / (2 * bins);
+	HCubeFile4::createFromRaw("hcube_grid_test.raw", 2 * bins,
+			Vector3f(bins * step, step, 2 * step), size, 0.01, 1e-10, 1,
+			"hcube_grid_test_slabs.hc4", false);
+	HCubeFile4 region("hcube_grid_test_slabs.hc4");
+	test_same_values(file->hcube(), region.hcube());
+
+	// the field has to match the depth
+	bool thrown = false;
+	try {
+		HCubeFile4::createFromRaw("hcube_grid_test.raw", bins, Vector3f(0, 0, 0),
+				size, 0.01, 1e-10, 2, "hcube_grid_test_slabs.hc4", false);
+	} catch (std::runtime_error &e) {
+		thrown = true;
+	}
+	if (!thrown)
+		throw std::runtime_error("field of the wrong size accepted!");
+}
+
+void test_checkpoint() {
+	std::cout << ">> checkpoint" << std::endl;
+	HCubeInitFlags flags;
+	flags.offsetKpc = Vector3f(-8, 0, 8);
+	flags.sizeKpc = size;
+	std::remove("hcube_grid_test.checkpoint");
+	{
+		HCubeInitCheckpoint checkpoint("hcube_grid_test.checkpoint", 2);
+		checkpoint.done(flags, flags.offsetKpc + Vector3f(4, 8, 12), 4, 10);
+		checkpoint.done(flags, flags.offsetKpc + Vector3f(4, 8, 12), 1, 20);
+		checkpoint.done(flags, flags.offsetKpc, size, 30);
+	}
+	{
+		// torn record
+		std::ofstream out("hcube_grid_test.checkpoint",
+				std::ios::binary | std::ios::app);
+		out.write("torn", 4);
+	}
+
+	HCubeInitCheckpoint checkpoint("hcube_grid_test.checkpoint");
+	if (checkpoint.end(flags, flags.offsetKpc + Vector3f(4, 8, 12), 4) != 10
+			|| checkpoint.end(flags, flags.offsetKpc + Vector3f(4, 8, 12), 1) != 20
+			|| checkpoint.end(flags, flags.offsetKpc, size) != 30
+			|| checkpoint.end(flags, flags.offsetKpc, 4) != 0)
+		throw std::runtime_error("unexpected checkpoint!");
+
+	checkpoint.done(flags, flags.offsetKpc + Vector3f(0, 0, 4), 4, 40);
+	checkpoint.flush();
+	HCubeInitCheckpoint reloaded("hcube_grid_test.checkpoint");
+	if (reloaded.end(flags, flags.offsetKpc + Vector3f(0, 0, 4), 4) != 40
+			|| reloaded.end(flags, flags.offsetKpc, size) != 30)
+		throw std::runtime_error("record after torn tail lost!");
+
+	// invalidating a subcube drops the records inside it, also on reload
+	reloaded.done(flags, flags.offsetKpc + Vector3f(8, 8, 12), 1, 50);
+	reloaded.invalidate(flags, flags.offsetKpc + Vector3f(0, 8, 8), 8);
+	if (reloaded.end(flags, flags.offsetKpc + Vector3f(4, 8, 12), 4) != 10)
+		throw std::runtime_error("invalidated record dropped before drop!");
+	reloaded.drop();
+	if (reloaded.end(flags, flags.offsetKpc + Vector3f(4, 8, 12), 4) != 0)
+		throw std::runtime_error("invalidated record kept!");
+	HCubeInitCheckpoint invalidated("hcube_grid_test.checkpoint");
+	if (invalidated.end(flags, flags.offsetKpc + Vector3f(4, 8, 12), 4) != 0
+			|| invalidated.end(flags, flags.offsetKpc + Vector3f(4, 8, 12), 1) != 0
+			|| invalidated.end(flags, flags.offsetKpc + Vector3f(8, 8, 12), 1) != 50
+			|| invalidated.end(flags, flags.offsetKpc + Vector3f(0, 0, 4), 4) != 40
+			|| invalidated.end(flags, flags.offsetKpc, size) != 30)
+		throw std::runtime_error("unexpected invalidated checkpoint!");
+	std::remove("hcube_grid_test.checkpoint");
+}
+
+void build(Database *db, size_t levels, std::vector<HCube4> &cubes) {
+	const size_t maxdepth = 2;
+	cubes.resize(HCube4::regionSize(maxdepth));
+
+	HCubeInitFlags flags;
+	flags.error = 0.1;
+	flags.threshold = 1e-3;
+	flags.maxdepth = maxdepth;
+	flags.target_depth = maxdepth;
+	flags.offsetKpc = Vector3f(0, 0, 0);
+	flags.sizeKpc = size;
+	flags.presampling = 4;
+	flags.verbose = false;
+
+	std::remove("hcube_grid_test.checkpoint");
+	HCubeInitCheckpoint checkpoint("hcube_grid_test.checkpoint");
+	size_t idx = 0;
+#pragma omp parallel
+#pragma omp single
+	cubes[0].initParallel(db, flags.offsetKpc, size, 0, idx, flags, checkpoint,
+			levels);
+	cubes.resize(idx);
+	std::remove("hcube_grid_test.checkpoint");
+}
+
+void test_streaming_build(Database *db, const std::vector<HCube4> &expected) {
+	std::cout << ">> streaming build" << std::endl;
+	HCubeInitFlags flags;
+	flags.error = 0.1;
+	flags.threshold = 1e-3;
+	flags.maxdepth = 2;
+	flags.target_depth = 2;
+	flags.offsetKpc = Vector3f(0, 0, 0);
+	flags.sizeKpc = size;
+	flags.presampling = 4;
+	flags.verbose = false;
+
+	std::remove("hcube_grid_test.checkpoint");
+	HCubeInitCheckpoint checkpoint("hcube_grid_test.checkpoint");
+	std::vector<HCube4> root(1);
+	size_t idx = 0;
+	{
+		// smaller than two cubes, forces flushes and split writes
+		BufferedFileWrite out("hcube_grid_test_stream.hc4", 1000);
+		HCube4::stream(db, flags.offsetKpc, size, 0, idx, flags, checkpoint, out,
+				root[0]);
+		out.truncate(HCubeHeader::dataOffset + idx * sizeof(HCube4));
+	}
+	std::remove("hcube_grid_test.checkpoint");
+
+	if (idx != expected.size())
+		throw std::runtime_error("unexpected number of streamed cubes!");
+
+	std::vector<HCube4> cubes(idx);
+	std::ifstream in("hcube_grid_test_stream.hc4", std::ios::binary);
+	in.seekg(HCubeHeader::dataOffset);
+	in.read((char *) cubes.data(), idx * sizeof(HCube4));
+	if (!in || memcmp(cubes.data(), expected.data(), idx * sizeof(HCube4)))
+		throw std::runtime_error("streaming build differs!");
+}
+
+void test_merge(Database *db) {
+	std::cout << ">> merge" << std::endl;
+	std::vector<std::string> files(64);
+	std::vector<ref_ptr<HCubeFile4> > pieces(files.size());
+	std::vector<const HCube4 *> srcs(files.size());
+	size_t count = 1;
+
+	for (size_t n = 0; n < files.size(); n++) {
+		std::ostringstream name;
+		name << "hcube_grid_test_piece.hc4.0." << n;
+		files[n] = name.str();
+		Vector3f offset(n / 16, (n / 4) % 4, n % 4);
+		HCubeFile4::create(db, offset * (size / 4), size / 4, 0.1, 1e-3, 1, 1,
+				files[n], 0, false);
+		pieces[n] = new HCubeFile4(files[n]);
+		srcs[n] = pieces[n]->hcube();
+		count += pieces[n]->getCubeCount();
+	}
+
+	HCubeFile4::create(files, 0, 0.1, 1e-3, 2, 2, "hcube_grid_test_merged.hc4");
+
+	// serial merge for comparison
+	HCubeInitFlags flags;
+	flags.error = 0.1;
+	flags.threshold = 1e-3;
+	flags.maxdepth = 2;
+	flags.target_depth = 2;
+	std::vector<HCube4> expected(count);
+	size_t idx = 0;
+	expected[0].init(srcs, idx, flags, 0);
+
+	HCubeFile4 merged("hcube_grid_test_merged.hc4");
+	if (idx < 2 || merged.getCubeCount() != idx)
+		throw std::runtime_error("unexpected number of merged cubes!");
+	if (memcmp(merged.hcube(), expected.data(), idx * sizeof(HCube4)))
+		throw std::runtime_error("parallel merge differs!");
+
+	// a piece with an offset out of bounds is rejected
+	HCube4 broken = *srcs[0];
+	broken.setCube(0, 0, 0, 1000);
+	{
+		std::ofstream out(files[0].c_str(), std::ios::binary | std::ios::in);
+		out.seekp(HCubeHeader::dataOffset);
+		out.write((const char *) &broken, sizeof(HCube4));
+	}
+	pieces.clear();
+
+	bool rejected = false;
+	try {
+		HCubeFile4::create(files, 0, 0.1, 1e-3, 2, 2, "hcube_grid_test_merged.hc4");
+	} catch (std::runtime_error &e) {
+		rejected = true;
+	}
+	if (!rejected)
+		throw std::runtime_error("invalid merge piece accepted!");
+
+	for (size_t n = 0; n < files.size(); n++)
+		std::remove(files[n].c_str());
+}
+
+void test_element_types(Database *db) {
+	std::cout << ">> element types" << std::endl;
+	std::vector<SmoothParticle> particles;
+	db->getParticles(db->getLowerBounds() - Vector3f(size),
+			db->getUpperBounds() + Vector3f(size), particles);
+	const Vector3f origin(0, 0, 0);
+	HCubeFile4::create(db, origin, size, 0, 0, 1, 1, "hcube_grid_test_b.hc4", 0,
+			false);
+	HCubeFile<4, float>::create(db, origin, size, 0, 0, 1, 1,
+			"hcube_grid_test_rho.hc4", 0, false);
+	HCubeFile<4, HCubeBRho>::create(db, origin, size, 0, 0, 1, 1,
+			"hcube_grid_test_brho.hc4", 0, false);
+
+	HCubeFile4 b("hcube_grid_test_b.hc4");
+	HCubeFile<4, float> rho("hcube_grid_test_rho.hc4");
+	HCubeFile<4, HCubeBRho> brho("hcube_grid_test_brho.hc4");
+	if (rho.header().encoding != HCubeScalarFloat
+			|| brho.header().encoding != HCubeBRhoFloat)
+		throw std::runtime_error("unexpected element encoding!");
+	if (rho.getCubeCount() < 2 || brho.getCubeCount() < 2)
+		throw std::runtime_error("unexpected number of cubes!");
+
+	bool rejected = false;
+	try {
+		HCubeFile<4, float> wrong("hcube_grid_test_b.hc4");
+	} catch (std::runtime_error &e) {
+		rejected = true;
+	}
+	if (!rejected)
+		throw std::runtime_error("file with other elements accepted!");
+
+	// leaf cells hold the SPH sums at their centers
+	const float cell = size / 16;
+	for (size_t n = 0; n < 20; n++) {
+		Vector3f p = Vector3f(n % 16, (n * 7) % 16, (n * 3) % 8) * cell
+				+ Vector3f(cell / 2);
+		float expected = 0;
+		for (size_t i = 0; i < particles.size(); i++)
+			expected += sampleDensity(particles[i]) * particles[i].kernel(p);
+
+		test_close(rho.hcube()->getValue(p, size), expected);
+		test_close(brho.hcube()->getValue(p, size).rho, expected);
+		test_vector(brho.hcube()->getValue(p, size).b,
+				b.hcube()->getValue(p, size));
+	}
+
+	// batched lookups of the other element types
+	std::vector<float> x(100), y(100), z(100), values(100);
+	std::vector<HCubeBRho> both(100);
+	for (size_t i = 0; i < x.size(); i++) {
+		x[i] = drand48() * size;
+		y[i] = drand48() * size;
+		z[i] = drand48() * size;
+	}
+	if (!rho.hcube()->getValues(x.data(), y.data(), z.data(), values.data(),
+			x.size(), size) || !brho.hcube()->getValues(x.data(), y.data(),
+			z.data(), both.data(), x.size(), size))
+		throw std::runtime_error("batched lookup failed!");
+	for (size_t i = 0; i < x.size(); i++) {
+		Vector3f p(x[i], y[i], z[i]);
+		if (values[i] != rho.hcube()->getValue(p, size)
+				|| both[i].rho != brho.hcube()->getValue(p, size).rho)
+			throw std::runtime_error("batched lookup differs!");
+		test_vector(both[i].b, brho.hcube()->getValue(p, size).b);
+	}
+
+	// a small structured field is not collapsed by a large uniform density,
+	// nor the other way round
+	std::vector<HCubeBRho> e(64);
+	for (size_t i = 0; i < e.size(); i++)
+		e[i] = HCubeBRho(Vector3f(1e-3 * (i % 2), 0, 0), 1e3);
+	HCubeBRho mean;
+	if (collapseElements(e.data(), e.size(), 0.1, 1e-6, mean))
+		throw std::runtime_error("field structure collapsed by the density!");
+	for (size_t i = 0; i < e.size(); i++)
+		e[i] = HCubeBRho(Vector3f(1e3, 0, 0), 1e-3 * (i % 2));
+	if (collapseElements(e.data(), e.size(), 0.1, 1e-6, mean))
+		throw std::runtime_error("density structure collapsed by the field!");
+	for (size_t i = 0; i < e.size(); i++)
+		e[i] = HCubeBRho(Vector3f(1e-3, 0, 0), 1e3 * (1 + 1e-3 * (i % 2)));
+	if (!collapseElements(e.data(), e.size(), 0.1, 1e-6, mean))
+		throw std::runtime_error("uniform elements not collapsed!");
+
+	// scalar child references use the sign bit for offsets from 2^22 on
+	const uint64_t offsets[] = { 1000, (1 << 22) + 1000, (1 << 23) - 1 };
+	for (size_t i = 0; i < 3; i++) {
+		float f;
+		HCubeElement<float>::setCube(f, offsets[i]);
+		if (!HCubeElement<float>::isCube(f)
+				|| HCubeElement<float>::toOffset(f) != offsets[i])
+			throw std::runtime_error("invalid scalar child reference!");
+	}
+
+	rejected = false;
+	try {
+		float f;
+		HCubeElement<float>::setCube(f, 1 << 23);
+	} catch (HCubeOffsetError &e) {
+		rejected = true;
+	}
+	if (!rejected)
+		throw std::runtime_error("scalar child offset beyond 23 bit accepted!");
+}
+
+void test_parallel_build() {
+	std::cout << ">> parallel build" << std::endl;
+	std::vector<SmoothParticle> particles(500);
+	srand48(1);
+	for (size_t i = 0; i < particles.size(); i++) {
+		SmoothParticle &p = particles[i];
+		p.position = Vector3f(drand48(), drand48(), drand48() * 0.5) * size;
+		p.bfield = Vector3f(drand48(), drand48(), drand48());
+		p.smoothingLength = 1 + drand48();
+		p.mass = 1;
+		p.rho = 1;
+	}
+	FileDatabase::create(particles, "hcube_grid_test.db", 4);
+	ref_ptr<FileDatabase> db = new FileDatabase("hcube_grid_test.db");
+
+	std::vector<HCube4> serial, parallel;
+	build(db, 0, serial);
+	build(db, 2, parallel);
+
+	if (serial.size() < 2 || serial.size() != parallel.size())
+		throw std::runtime_error("unexpected number of cubes!");
+	if (memcmp(serial.data(), parallel.data(), serial.size() * sizeof(HCube4)))
+		throw std::runtime_error("parallel build differs!");
+
+	test_streaming_build(db, serial);
+	test_merge(db);
+	test_element_types(db);
+
+	std::cout << ">> repack" << std::endl;
+	test_repack(serial);
+}
+
+int main() {
+	Grid<Vector3f> grid;
+	create_grid(grid);
+
+	HCubeFile4::create(grid, Vector3f(0, 0, 0), size, 0.01, 1e-10, 1,
+			"hcube_grid_test.hc4");
+
+	ref_ptr<HCubeFile4> file = new HCubeFile4("hcube_grid_test.hc4");
+	const HCube4 *hcube = file->hcube();
+
+	test_getValues(hcube);
+	test_lookup(file);
+	test_cache(file);
+	test_integrate(file);
+	test_header(file);
+	test_interpolate(file);
+	test_jacobian(file);
+	test_half();
+	test_means();
+	test_recompress(file);
+	test_extract(hcube);
+	test_slab_build(grid, file);
+	test_checkpoint();
+
+	HCubeFile4::repack("hcube_grid_test.hc4", "hcube_grid_test_morton.hc4");
+	HCubeFile4 morton("hcube_grid_test_morton.hc4");
+	if (morton.header().layout != HCubeMortonLevels
+			|| morton.getCubeCount() != file->getCubeCount())
+		throw std::runtime_error("unexpected repacked header!");
+	test_same_values(hcube, morton.hcube());
+	test_parallel_build();
+	test_dedup();
+
+	std::cout << "done" << std::endl;
+	return 0;
+}
@@ -10,7 +10,7 @@ int main() {
 	float size = (db->getUpperBounds() - db->getLowerBounds()).length();
 
 	//hc.init(db, gadget.Vector3f(117200, 118600, 130500), 5000, 0.1, 0)
-	HCubeFile4::create(db, db->getLowerBounds(), size, 0.5, 1e-14, 2,
+	HCubeFile4::create(db, db->getLowerBounds(), size, 0.5, 1e-14, 2, 2,
 			"test.hc4");
 
 	HCubeFile4 hf4("test.hc4");
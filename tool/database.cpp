@@ -18,7 +18,10 @@ const char database_usage[] =
 				"-m     Mass to use, default: use value from file\n"
 				"-px, -py, -pz\n"
 				"       x, y, z of the pivot point for hubble streching, default: 120000\n"
-				"-bins  number of bins used for database lookup, default: 100\n";
+				"-bins  number of bins used for database lookup, default: 100\n"
+				"-soa   write the version 2 layout, one array per attribute\n"
+				"-payload\n"
+				"       write the version 3 layout with precomputed kernel payload\n";
 
 int database(Arguments &arguments) {
 	vector<string> files;
@@ -31,6 +34,8 @@ int database(Arguments &arguments) {
 	pivot.z = arguments.getFloat("-pz", 0);
 	float mass = arguments.getFloat("-m", 0);
 	size_t bins = arguments.getFloat("-bins", 100);
+	bool payload = arguments.hasFlag("-payload");
+	bool soa = payload || arguments.hasFlag("-soa");
 
 	if ((files.size() == 0) || (output.size() == 0)) {
 		cout << database_usage << endl;
@@ -137,7 +142,8 @@ int database(Arguments &arguments) {
 
 	cout << "create database with " << particles.size() << " particles."
 			<< endl;
-	FileDatabase::create(particles, output, bins, true);
+	FileDatabase::create(particles, output, bins, true,
+			payload ? 3 : (soa ? 2 : 1));
 
 	cout << "done." << endl;
 
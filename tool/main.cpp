@@ -7,8 +7,10 @@
 #include "quimby/PagedGrid.h"
 #include "quimby/Database.h"
 #include "quimby/HCube.h"
+#include "quimby/HCubeHalf.h"
 
 #include <cmath>
+#include <cstdio>
 #include <ctime>
 #include <cstdlib>
 #include <string>
@@ -147,6 +149,268 @@ int hc(Arguments& arguments) {
 	return 0;
 }
 
+bool hcrepack(size_t n, const std::string& input, const std::string& output) {
+	switch (n) {
+	case 2:
+		return HCubeFile<2>::repack(input, output);
+
+	case 4:
+		return HCubeFile<4>::repack(input, output);
+
+	case 8:
+		return HCubeFile<8>::repack(input, output);
+
+	case 16:
+		return HCubeFile<16>::repack(input, output);
+
+	case 32:
+		return HCubeFile<32>::repack(input, output);
+
+	case 64:
+		return HCubeFile<64>::repack(input, output);
+
+	case 128:
+		return HCubeFile<128>::repack(input, output);
+
+	default:
+		std::cout << "Invalid n: " << n << std::endl;
+		return false;
+	}
+}
+
+bool hcdedup(size_t n, const std::string& input, const std::string& output) {
+	switch (n) {
+	case 2:
+		return HCubeFile<2>::deduplicate(input, output);
+
+	case 4:
+		return HCubeFile<4>::deduplicate(input, output);
+
+	case 8:
+		return HCubeFile<8>::deduplicate(input, output);
+
+	case 16:
+		return HCubeFile<16>::deduplicate(input, output);
+
+	case 32:
+		return HCubeFile<32>::deduplicate(input, output);
+
+	case 64:
+		return HCubeFile<64>::deduplicate(input, output);
+
+	case 128:
+		return HCubeFile<128>::deduplicate(input, output);
+
+	default:
+		std::cout << "Invalid n: " << n << std::endl;
+		return false;
+	}
+}
+
+int hcdedup(Arguments& arguments) {
+	std::string input = arguments.getString("-i", "hcube.hc4");
+	std::cout << "Input: " << input << std::endl;
+
+	std::string output = arguments.getString("-o", "hcube-dedup.hc4");
+	std::cout << "Output: " << output << std::endl;
+
+	HCubeHeader header;
+
+	if (!HCubeHeader::read(input, header)) {
+		std::cout << "Error: no HCube header: " << input << std::endl;
+		return 1;
+	}
+
+	std::cout << "N: " << header.n << std::endl;
+	std::cout << "Cubes: " << header.cubes << std::endl;
+
+	if (!hcdedup(header.n, input, output))
+		return 1;
+
+	HCubeHeader::read(output, header);
+	std::cout << "Unique Cubes: " << header.cubes << std::endl;
+	return 0;
+}
+
+int hcrepack(Arguments& arguments) {
+	std::string input = arguments.getString("-i", "hcube.hc4");
+	std::cout << "Input: " << input << std::endl;
+
+	std::string output = arguments.getString("-o", "hcube-morton.hc4");
+	std::cout << "Output: " << output << std::endl;
+
+	HCubeHeader header;
+
+	if (!HCubeHeader::read(input, header)) {
+		std::cout << "Error: no HCube header: " << input << std::endl;
+		return 1;
+	}
+
+	std::cout << "N: " << header.n << std::endl;
+	std::cout << "Cubes: " << header.cubes << std::endl;
+
+	return hcrepack(header.n, input, output) ? 0 : 1;
+}
+
+int hchalf(Arguments& arguments) {
+	std::string input = arguments.getString("-i", "hcube.hc4");
+	std::cout << "Input: " << input << std::endl;
+
+	std::string output = arguments.getString("-o", "hcube-half.hc4");
+	std::cout << "Output: " << output << std::endl;
+
+	// report elements beyond the error of the input instead of failing
+	bool strict = !arguments.hasFlag("-loose");
+	std::cout << "Strict: " << (strict ? "yes" : "no") << std::endl;
+
+	HCubeHeader header;
+
+	if (!HCubeHeader::read(input, header)) {
+		std::cout << "Error: no HCube header: " << input << std::endl;
+		return 1;
+	}
+
+	std::cout << "N: " << header.n << std::endl;
+	std::cout << "Cubes: " << header.cubes << std::endl;
+
+	switch (header.n) {
+	case 2:
+		return HCubeHalfFile<2>::create(input, output, strict) ? 0 : 1;
+
+	case 4:
+		return HCubeHalfFile<4>::create(input, output, strict) ? 0 : 1;
+
+	case 8:
+		return HCubeHalfFile<8>::create(input, output, strict) ? 0 : 1;
+
+	case 16:
+		return HCubeHalfFile<16>::create(input, output, strict) ? 0 : 1;
+
+	case 32:
+		return HCubeHalfFile<32>::create(input, output, strict) ? 0 : 1;
+
+	case 64:
+		return HCubeHalfFile<64>::create(input, output, strict) ? 0 : 1;
+
+	default:
+		std::cout << "Invalid n: " << header.n << std::endl;
+		return 1;
+	}
+}
+
+bool hcmeans(size_t n, const std::string& filename) {
+	switch (n) {
+	case 2:
+		return HCubeFile<2>::appendMeans(filename);
+
+	case 4:
+		return HCubeFile<4>::appendMeans(filename);
+
+	case 8:
+		return HCubeFile<8>::appendMeans(filename);
+
+	case 16:
+		return HCubeFile<16>::appendMeans(filename);
+
+	case 32:
+		return HCubeFile<32>::appendMeans(filename);
+
+	case 64:
+		return HCubeFile<64>::appendMeans(filename);
+
+	case 128:
+		return HCubeFile<128>::appendMeans(filename);
+
+	default:
+		std::cout << "Invalid n: " << n << std::endl;
+		return false;
+	}
+}
+
+int hcmeans(Arguments& arguments) {
+	std::string input = arguments.getString("-i", "hcube.hc4");
+	std::cout << "Input: " << input << std::endl;
+
+	HCubeHeader header;
+
+	if (!HCubeHeader::read(input, header)) {
+		std::cout << "Error: no HCube header: " << input << std::endl;
+		return 1;
+	}
+
+	std::cout << "N: " << header.n << std::endl;
+	std::cout << "Cubes: " << header.cubes << std::endl;
+
+	return hcmeans(header.n, input) ? 0 : 1;
+}
+
+int hcrecompress(Arguments& arguments) {
+	std::string input = arguments.getString("-i", "hcube.hc4");
+	std::cout << "Input: " << input << std::endl;
+
+	std::string output = arguments.getString("-o", "hcube-recompressed.hc4");
+	std::cout << "Output: " << output << std::endl;
+
+	HCubeHeader header;
+
+	if (!HCubeHeader::read(input, header)) {
+		std::cout << "Error: no HCube header: " << input << std::endl;
+		return 1;
+	}
+
+	std::cout << "N: " << header.n << std::endl;
+	std::cout << "Cubes: " << header.cubes << std::endl;
+
+	float threshold = arguments.getFloat("-t", header.threshold);
+	std::cout << "Threshold: " << threshold << std::endl;
+
+	float error = arguments.getFloat("-e", header.error);
+	std::cout << "Error: " << error << std::endl;
+
+	bool ok = false;
+
+	switch (header.n) {
+	case 2:
+		ok = HCubeFile<2>::recompress(input, output, error, threshold);
+		break;
+
+	case 4:
+		ok = HCubeFile<4>::recompress(input, output, error, threshold);
+		break;
+
+	case 8:
+		ok = HCubeFile<8>::recompress(input, output, error, threshold);
+		break;
+
+	case 16:
+		ok = HCubeFile<16>::recompress(input, output, error, threshold);
+		break;
+
+	case 32:
+		ok = HCubeFile<32>::recompress(input, output, error, threshold);
+		break;
+
+	case 64:
+		ok = HCubeFile<64>::recompress(input, output, error, threshold);
+		break;
+
+	case 128:
+		ok = HCubeFile<128>::recompress(input, output, error, threshold);
+		break;
+
+	default:
+		std::cout << "Invalid n: " << header.n << std::endl;
+		return 1;
+	}
+
+	if (!ok)
+		return 1;
+
+	HCubeHeader::read(output, header);
+	std::cout << "New Cubes: " << header.cubes << std::endl;
+	return 0;
+}
+
 int hcdb(Arguments& arguments) {
 	size_t n = arguments.getInt("-n", 4);
 	std::cout << "N: " << n << std::endl;
@@ -166,6 +430,26 @@ int hcdb(Arguments& arguments) {
 	std::string output = arguments.getString("-o", "hcube.hc4");
 	std::cout << "Output: " << output << std::endl;
 
+	size_t parallel_levels = arguments.getInt("-parallel", 1);
+	std::cout << "Parallel Levels: " << parallel_levels << std::endl;
+
+	// limit of the sparse mapping in GiB, parallel builds need the full tree
+	size_t max_mapping = (size_t) arguments.getInt("-max-mapping", 1024) << 30;
+	std::cout << "Max Mapping: " << (max_mapping >> 30) << " GiB" << std::endl;
+
+	bool dedup = arguments.hasFlag("-dedup");
+	std::cout << "Deduplicate: " << (dedup ? "yes" : "no") << std::endl;
+
+	bool morton = arguments.hasFlag("-morton");
+	std::cout << "Morton Layout: " << (morton ? "yes" : "no") << std::endl;
+
+	bool means = arguments.hasFlag("-means");
+	std::cout << "Means: " << (means ? "yes" : "no") << std::endl;
+
+	// stream finished subcubes to the file instead of a sparse mapping, serial
+	bool stream = arguments.hasFlag("-stream");
+	std::cout << "Streaming: " << (stream ? "yes" : "no") << std::endl;
+
 	std::vector<std::string> databases;
 	arguments.getVector("-db", databases);
 
@@ -280,6 +564,40 @@ int hcdb(Arguments& arguments) {
 			HCubeFile<128>::create(srcs, levels, error, threshold, depth, target_depth, output);
 			break;
 
+		default:
+			std::cout << "Invalid n: " << n << std::endl;
+			break;
+		}
+	} else if (stream) {
+		switch (n) {
+		case 2:
+			HCubeFile<2>::createStreaming(&db, offsetKpc, sizeKpc, error, threshold, depth, target_depth, output);
+			break;
+
+		case 4:
+			HCubeFile<4>::createStreaming(&db, offsetKpc, sizeKpc, error, threshold, depth, target_depth, output);
+			break;
+
+		case 8:
+			HCubeFile<8>::createStreaming(&db, offsetKpc, sizeKpc, error, threshold, depth, target_depth, output);
+			break;
+
+		case 16:
+			HCubeFile<16>::createStreaming(&db, offsetKpc, sizeKpc, error, threshold, depth, target_depth, output);
+			break;
+
+		case 32:
+			HCubeFile<32>::createStreaming(&db, offsetKpc, sizeKpc, error, threshold, depth, target_depth, output);
+			break;
+
+		case 64:
+			HCubeFile<64>::createStreaming(&db, offsetKpc, sizeKpc, error, threshold, depth, target_depth, output);
+			break;
+
+		case 128:
+			HCubeFile<128>::createStreaming(&db, offsetKpc, sizeKpc, error, threshold, depth, target_depth, output);
+			break;
+
 		default:
 			std::cout << "Invalid n: " << n << std::endl;
 			break;
@@ -289,31 +607,31 @@ int hcdb(Arguments& arguments) {
 
 		switch (n) {
 		case 2:
-			HCubeFile<2>::create(&db, offsetKpc, sizeKpc, error, threshold, depth, target_depth, output);
+			HCubeFile<2>::create(&db, offsetKpc, sizeKpc, error, threshold, depth, target_depth, output, parallel_levels, true, max_mapping);
 			break;
 
 		case 4:
-			HCubeFile<4>::create(&db, offsetKpc, sizeKpc, error, threshold, depth, target_depth, output);
+			HCubeFile<4>::create(&db, offsetKpc, sizeKpc, error, threshold, depth, target_depth, output, parallel_levels, true, max_mapping);
 			break;
 
 		case 8:
-			HCubeFile<8>::create(&db, offsetKpc, sizeKpc, error, threshold, depth, target_depth, output);
+			HCubeFile<8>::create(&db, offsetKpc, sizeKpc, error, threshold, depth, target_depth, output, parallel_levels, true, max_mapping);
 			break;
 
 		case 16:
-			HCubeFile<16>::create(&db, offsetKpc, sizeKpc, error, threshold, depth, target_depth, output);
+			HCubeFile<16>::create(&db, offsetKpc, sizeKpc, error, threshold, depth, target_depth, output, parallel_levels, true, max_mapping);
 			break;
 
 		case 32:
-			HCubeFile<32>::create(&db, offsetKpc, sizeKpc, error, threshold, depth, target_depth, output);
+			HCubeFile<32>::create(&db, offsetKpc, sizeKpc, error, threshold, depth, target_depth, output, parallel_levels, true, max_mapping);
 			break;
 
 		case 64:
-			HCubeFile<64>::create(&db, offsetKpc, sizeKpc, error, threshold, depth, target_depth, output);
+			HCubeFile<64>::create(&db, offsetKpc, sizeKpc, error, threshold, depth, target_depth, output, parallel_levels, true, max_mapping);
 			break;
 
 		case 128:
-			HCubeFile<128>::create(&db, offsetKpc, sizeKpc, error, threshold, depth, target_depth, output);
+			HCubeFile<128>::create(&db, offsetKpc, sizeKpc, error, threshold, depth, target_depth, output, parallel_levels, true, max_mapping);
 			break;
 
 		default:
@@ -322,6 +640,29 @@ int hcdb(Arguments& arguments) {
 		}
 	}
 
+	if (idx == invalid_idx && dedup) {
+		std::string tmp = output + ".dedup";
+
+		if (!hcdedup(n, output, tmp) || std::rename(tmp.c_str(), output.c_str())) {
+			std::cout << "Error: deduplication failed: " << output << std::endl;
+			return 1;
+		}
+	}
+
+	if (idx == invalid_idx && morton) {
+		std::string tmp = output + ".morton";
+
+		if (!hcrepack(n, output, tmp) || std::rename(tmp.c_str(), output.c_str())) {
+			std::cout << "Error: repack failed: " << output << std::endl;
+			return 1;
+		}
+	}
+
+	if (idx == invalid_idx && means && !hcmeans(n, output)) {
+		std::cout << "Error: computing means failed: " << output << std::endl;
+		return 1;
+	}
+
 	if (idx == invalid_idx) {
 		size_t d = output.find_last_of(".");
 		std::string cfgname = output.substr(0, d) + ".cfg";
@@ -434,10 +775,8 @@ int bigfield(Arguments& arguments) {
 		std::cout << "  Lower: " << lower << "\n";
 		std::cout << "  Upper: " << upper << std::endl;
 		SimpleSamplingVisitor v(data, bins, lower, sizeKpc);
-		v.showProgress(true);
-
 		v.limit(0, chunkSizeBins - 1, 0, bins, 0, bins);
-		db.accept(v);
+		v.sample(db);
 		std::cout << std::endl;
 		::fwrite(data, n2 * sizeof(Vector3f), chunkSizeBins, fd);
 	}
@@ -1142,6 +1481,16 @@ int main(int argc, const char** argv) {
 			return hc(arguments);
 		else if (function == "hcdb")
 			return hcdb(arguments);
+		else if (function == "hcrepack")
+			return hcrepack(arguments);
+		else if (function == "hcdedup")
+			return hcdedup(arguments);
+		else if (function == "hchalf")
+			return hchalf(arguments);
+		else if (function == "hcmeans")
+			return hcmeans(arguments);
+		else if (function == "hcrecompress")
+			return hcrecompress(arguments);
 		else if (function == "bfieldtest")
 			return bfieldtest(arguments);
 		else if (function == "pp")
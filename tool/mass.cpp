@@ -69,6 +69,12 @@ public:
 		return box.intersects(lower - Vector3f(margin),
 				upper + Vector3f(margin));
 	}
+
+	bool getBounds(Vector3f &lower, Vector3f &upper) {
+		lower = box.min;
+		upper = box.max;
+		return true;
+	}
 };
 
 int mass(Arguments &arguments) {